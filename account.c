@@ -0,0 +1,261 @@
+/* account.c - per-uid and per-cgroup cost accounting for rewritefs
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <fuse.h>
+
+#include "rewrite.h"
+#include "trace.h"
+#include "account.h"
+
+/* Beyond this number of uids or of cgroups, costs go to "other", so that
+ * short-lived containers can't grow the tables without bound */
+#define ACCOUNT_MAX 1024
+
+/* Cgroups of the last callers, by pid. Entries expire so that reused pids
+ * and processes moved to another cgroup are eventually seen. */
+#define PID_CACHE_SIZE 256
+#define PID_CACHE_TTL 10
+
+struct account {
+    uid_t uid;
+    char *cgroup; /* NULL for uid accounts */
+    unsigned long counters[ACCOUNT_COUNTERS];
+    struct account *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct account *users, *cgroups;
+    size_t nusers, ncgroups;
+    struct account other_user, other_cgroup;
+    struct {
+        pid_t pid;
+        time_t expires;
+        struct account *cgroup;
+    } pids[PID_CACHE_SIZE];
+} accounts = { PTHREAD_MUTEX_INITIALIZER };
+
+static const char *counter_names[ACCOUNT_COUNTERS] = {
+    "rewrites", "rewrite_usec", "caller_usec", "backing_usec", "bytes read", "bytes written"
+};
+
+/* How well a line of /proc/pid/cgroup, "id:controllers:path", names the
+ * group of a process: the cgroup v2 hierarchy is the one, and with cgroup
+ * v1 the systemd and cpu hierarchies follow services and containers, while
+ * the others often keep processes in their root */
+static int cgroup_rank(const char *line, const char *path) {
+    const char *controller = strchr(line, ':') + 1, *end;
+    size_t len;
+    int rank = 1;
+
+    if(!strncmp(line, "0::", 3))
+        return 4;
+    for(; controller < path; controller = end + 1) {
+        end = memchr(controller, ',', path - controller);
+        if(end == NULL)
+            end = path;
+        len = end - controller;
+        if(len == strlen("name=systemd") && !strncmp(controller, "name=systemd", len))
+            return 3;
+        if(len == strlen("cpu") && !strncmp(controller, "cpu", len))
+            rank = 2;
+    }
+    return rank;
+}
+
+/* The cgroup v2 path of pid or, with cgroup v1, its path in the best
+ * hierarchy according to cgroup_rank. Returns malloc'd memory, or NULL. */
+static char *read_cgroup(pid_t pid) {
+    char file[32], *line = NULL, *path, *cgroup = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int rank, best = 0;
+    FILE *fd;
+
+    snprintf(file, sizeof(file), "/proc/%d/cgroup", pid);
+    fd = fopen(file, "r");
+    if(fd == NULL)
+        return NULL;
+    while(best < 4 && (len = getline(&line, &size, fd)) > 0) {
+        if(line[len - 1] == '\n')
+            line[len - 1] = 0;
+        path = strchr(line, ':');
+        path = path ? strchr(path + 1, ':') : NULL;
+        if(path == NULL)
+            continue;
+        rank = cgroup_rank(line, path);
+        if(rank > best) {
+            free(cgroup);
+            cgroup = strdup(path + 1);
+            best = rank;
+        }
+    }
+    free(line);
+    fclose(fd);
+    return cgroup;
+}
+
+/* Must be called with accounts.lock held */
+static struct account *new_account(uid_t uid, char *cgroup) {
+    struct account *account = calloc(1, sizeof(struct account));
+
+    if(account == NULL) {
+        perror("calloc");
+        abort();
+    }
+    account->uid = uid;
+    account->cgroup = cgroup;
+    if(cgroup) {
+        account->next = accounts.cgroups;
+        accounts.cgroups = account;
+        accounts.ncgroups++;
+    } else {
+        account->next = accounts.users;
+        accounts.users = account;
+        accounts.nusers++;
+    }
+    return account;
+}
+
+/* Must be called with accounts.lock held */
+static struct account *user_account(uid_t uid) {
+    struct account *account;
+
+    for(account = accounts.users; account != NULL; account = account->next)
+        if(account->uid == uid)
+            return account;
+    if(accounts.nusers >= ACCOUNT_MAX)
+        return &accounts.other_user;
+    return new_account(uid, NULL);
+}
+
+/* Must be called with accounts.lock held. Takes cgroup. */
+static struct account *cgroup_account(char *cgroup) {
+    struct account *account;
+
+    if(cgroup == NULL)
+        return &accounts.other_cgroup;
+    for(account = accounts.cgroups; account != NULL; account = account->next) {
+        if(!strcmp(account->cgroup, cgroup)) {
+            free(cgroup);
+            return account;
+        }
+    }
+    if(accounts.ncgroups >= ACCOUNT_MAX) {
+        free(cgroup);
+        return &accounts.other_cgroup;
+    }
+    return new_account(0, cgroup);
+}
+
+/* Accounts of the caller of the last request of a thread, so that the
+ * several counters of a request, and the requests of a same process, are
+ * added without taking accounts.lock nor looking the accounts up */
+struct caller_accounts {
+    pid_t pid;
+    uid_t uid;
+    time_t expires; /* of the cgroup in accounts.pids */
+    struct account *user, *cgroup;
+};
+
+static pthread_key_t caller_key;
+static pthread_once_t caller_once = PTHREAD_ONCE_INIT;
+
+static void caller_key_init(void) {
+    pthread_key_create(&caller_key, free);
+}
+
+static void caller_lookup(struct caller_accounts *caller, struct fuse_context *ctx, time_t now) {
+    char *path;
+    int slot = ctx->pid % PID_CACHE_SIZE;
+
+    pthread_mutex_lock(&accounts.lock);
+    if(accounts.pids[slot].pid != ctx->pid || accounts.pids[slot].expires <= now) {
+        pthread_mutex_unlock(&accounts.lock);
+        path = read_cgroup(ctx->pid);
+        pthread_mutex_lock(&accounts.lock);
+        accounts.pids[slot].pid = ctx->pid;
+        accounts.pids[slot].expires = now + PID_CACHE_TTL;
+        accounts.pids[slot].cgroup = cgroup_account(path);
+    }
+    caller->pid = ctx->pid;
+    caller->uid = ctx->uid;
+    caller->expires = accounts.pids[slot].expires;
+    caller->cgroup = accounts.pids[slot].cgroup;
+    caller->user = user_account(ctx->uid);
+    pthread_mutex_unlock(&accounts.lock);
+}
+
+/* Add n to counter of the uid and the cgroup of the current caller */
+void account_add(enum account_counter counter, unsigned long n) {
+    struct fuse_context *ctx = fuse_get_context();
+    struct caller_accounts *caller;
+    time_t now;
+
+    /* not in a FUSE request: other threads get a zeroed context */
+    if(ctx == NULL || ctx->pid == 0)
+        return;
+
+    pthread_once(&caller_once, caller_key_init);
+    caller = pthread_getspecific(caller_key);
+    if(caller == NULL) {
+        caller = calloc(1, sizeof(struct caller_accounts));
+        if(caller == NULL) {
+            perror("calloc");
+            abort();
+        }
+        pthread_setspecific(caller_key, caller);
+    }
+    now = time(NULL);
+    if(caller->pid != ctx->pid || caller->uid != ctx->uid || caller->expires <= now)
+        caller_lookup(caller, ctx, now);
+
+    __atomic_fetch_add(&caller->user->counters[counter], n, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&caller->cgroup->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/* One line of counters, skipping unused "other" accounts */
+static void account_print(FILE *fd, const struct account *account) {
+    int i;
+
+    for(i = 0; i < ACCOUNT_COUNTERS && !account->counters[i]; i++);
+    if(i == ACCOUNT_COUNTERS && (account == &accounts.other_user || account == &accounts.other_cgroup))
+        return;
+    if(account == &accounts.other_user || account == &accounts.other_cgroup)
+        fprintf(fd, "  %s other: ", account == &accounts.other_user ? "uid" : "cgroup");
+    else if(account->cgroup)
+        fprintf(fd, "  cgroup %s: ", account->cgroup);
+    else
+        fprintf(fd, "  uid %u: ", (unsigned) account->uid);
+    for(i = 0; i < ACCOUNT_COUNTERS; i++)
+        fprintf(fd, "%s%lu %s", i ? ", " : "", account->counters[i], counter_names[i]);
+    fprintf(fd, "\n");
+}
+
+void account_stats(FILE *fd) {
+    struct account *account;
+
+    if(!ACCOUNTING)
+        return;
+    pthread_mutex_lock(&accounts.lock);
+    fprintf(fd, "accounts:\n");
+    for(account = accounts.users; account != NULL; account = account->next)
+        account_print(fd, account);
+    account_print(fd, &accounts.other_user);
+    for(account = accounts.cgroups; account != NULL; account = account->next)
+        account_print(fd, account);
+    account_print(fd, &accounts.other_cgroup);
+    pthread_mutex_unlock(&accounts.lock);
+}
@@ -0,0 +1,21 @@
+/* Per-uid and per-cgroup cost of the requests, with -o account. Costs are
+ * charged to the caller of the current FUSE request; work done by other
+ * threads, like warming, isn't charged to anyone. Times are measured with
+ * trace_usec. */
+enum account_counter {
+    ACCOUNT_REWRITES,
+    ACCOUNT_REWRITE_USEC, /* in rewrite(), including caller_usec */
+    ACCOUNT_CALLER_USEC, /* reading and matching caller command lines */
+    ACCOUNT_BACKING_USEC, /* in syscalls on the original filesystem */
+    ACCOUNT_BYTES_READ,
+    ACCOUNT_BYTES_WRITTEN,
+    ACCOUNT_COUNTERS
+};
+
+#define ACCOUNTING (config.account)
+#define ACCOUNT_START() (ACCOUNTING ? trace_usec() : 0)
+#define ACCOUNT_ELAPSED(start) (ACCOUNTING ? trace_usec() - (start) : 0)
+#define ACCOUNT_ADD(counter, n) if(ACCOUNTING) account_add(counter, n)
+
+void account_add(enum account_counter counter, unsigned long n);
+void account_stats(FILE *fd);
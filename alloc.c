@@ -0,0 +1,265 @@
+/* alloc.c - request arenas and slab pools for rewritefs
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "alloc.h"
+
+/*
+ * Request arenas
+ */
+#define ARENA_CHUNK 4096
+#define ARENA_MAX_KEPT 65536
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/* The arena of a thread and its counters. Only that thread writes them, so
+ * they are bumped without atomic read-modify-write; alloc_stats sums them
+ * over all threads. */
+struct arena {
+    struct arena_chunk *chunks;
+    unsigned long allocs, bytes, resets, chunk_mallocs, reserved;
+    struct arena *prev, *next;
+};
+
+#define ARENA_ADD(arena, field, n) \
+    __atomic_store_n(&(arena)->field, (arena)->field + (n), __ATOMIC_RELAXED)
+#define ARENA_GET(arena, field) __atomic_load_n(&(arena)->field, __ATOMIC_RELAXED)
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    pthread_mutex_t lock;
+    struct arena *list;
+    /* counters of the threads which exited */
+    unsigned long allocs, bytes, resets, chunk_mallocs;
+} arenas = { PTHREAD_MUTEX_INITIALIZER };
+
+static void free_chunks(struct arena *arena) {
+    struct arena_chunk *chunk, *next;
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        ARENA_ADD(arena, reserved, -chunk->size);
+        free(chunk);
+    }
+    arena->chunks = NULL;
+}
+
+static void arena_destroy(void *arg) {
+    struct arena *arena = arg;
+
+    free_chunks(arena);
+    pthread_mutex_lock(&arenas.lock);
+    arenas.allocs += arena->allocs;
+    arenas.bytes += arena->bytes;
+    arenas.resets += arena->resets;
+    arenas.chunk_mallocs += arena->chunk_mallocs;
+    if (arena->prev)
+        arena->prev->next = arena->next;
+    else
+        arenas.list = arena->next;
+    if (arena->next)
+        arena->next->prev = arena->prev;
+    pthread_mutex_unlock(&arenas.lock);
+    free(arena);
+}
+
+static void arena_key_init(void) {
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+/* The arena of this thread, created on its first use */
+static struct arena *get_arena(void) {
+    struct arena *arena;
+
+    pthread_once(&arena_once, arena_key_init);
+    arena = pthread_getspecific(arena_key);
+    if (arena != NULL)
+        return arena;
+    arena = calloc(1, sizeof(struct arena));
+    if (arena == NULL)
+        return NULL;
+    pthread_mutex_lock(&arenas.lock);
+    arena->next = arenas.list;
+    if (arenas.list)
+        arenas.list->prev = arena;
+    arenas.list = arena;
+    pthread_mutex_unlock(&arenas.lock);
+    pthread_setspecific(arena_key, arena);
+    return arena;
+}
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->chunks = chunk;
+    ARENA_ADD(arena, chunk_mallocs, 1);
+    ARENA_ADD(arena, reserved, size);
+    return chunk;
+}
+
+void *arena_alloc(size_t size) {
+    struct arena *arena = get_arena();
+    struct arena_chunk *chunk;
+    void *p;
+
+    if (arena == NULL)
+        return NULL;
+    chunk = arena->chunks;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        chunk = new_chunk(arena, size > ARENA_CHUNK ? size : ARENA_CHUNK);
+        if (chunk == NULL)
+            return NULL;
+    }
+
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    ARENA_ADD(arena, allocs, 1);
+    ARENA_ADD(arena, bytes, size);
+    return p;
+}
+
+/* Forget everything allocated in the arena of this thread. If the request
+ * needed more than one chunk, they are merged into a bigger one, up to
+ * ARENA_MAX_KEPT, so that the arena converges to a single allocation. */
+void arena_reset(void) {
+    struct arena *arena;
+    struct arena_chunk *chunk;
+    size_t total = 0;
+
+    pthread_once(&arena_once, arena_key_init);
+    arena = pthread_getspecific(arena_key);
+    if (arena == NULL || arena->chunks == NULL)
+        return;
+    ARENA_ADD(arena, resets, 1);
+
+    if (arena->chunks->next == NULL) {
+        arena->chunks->used = 0;
+        return;
+    }
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+        total += chunk->size;
+    free_chunks(arena);
+    new_chunk(arena, total < ARENA_MAX_KEPT ? total : ARENA_MAX_KEPT);
+}
+
+void arena_end(int *unused) {
+    (void) unused;
+    arena_reset();
+}
+
+/*
+ * Slab pools
+ */
+#define SLAB_CHUNK 64
+
+static struct slab *slabs;
+static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void slab_init(struct slab *slab, const char *name, size_t size) {
+    slab->name = name;
+    /* free objects hold the free list link */
+    slab->size = size < sizeof(void *) ? sizeof(void *) : size;
+    slab->size = (slab->size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pthread_mutex_init(&slab->lock, NULL);
+    slab->free_list = NULL;
+    slab->allocs = slab->frees = slab->in_use = slab->chunks = 0;
+
+    pthread_mutex_lock(&slabs_lock);
+    slab->next = slabs;
+    slabs = slab;
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+void *slab_alloc(struct slab *slab) {
+    char *chunk;
+    void *object;
+    int i;
+
+    pthread_mutex_lock(&slab->lock);
+    if (slab->free_list == NULL) {
+        chunk = malloc(slab->size * SLAB_CHUNK);
+        if (chunk == NULL) {
+            pthread_mutex_unlock(&slab->lock);
+            return NULL;
+        }
+        for (i = SLAB_CHUNK - 1; i >= 0; i--) {
+            *(void **)(chunk + i * slab->size) = slab->free_list;
+            slab->free_list = chunk + i * slab->size;
+        }
+        slab->chunks++;
+    }
+    object = slab->free_list;
+    slab->free_list = *(void **)object;
+    slab->allocs++;
+    slab->in_use++;
+    pthread_mutex_unlock(&slab->lock);
+    return object;
+}
+
+void slab_free(struct slab *slab, void *object) {
+    if (object == NULL)
+        return;
+    pthread_mutex_lock(&slab->lock);
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->frees++;
+    slab->in_use--;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+void alloc_stats(FILE *fd) {
+    struct slab *slab;
+    struct arena *arena;
+    unsigned long capacity, allocs, bytes, resets, chunk_mallocs, reserved = 0;
+
+    pthread_mutex_lock(&arenas.lock);
+    allocs = arenas.allocs;
+    bytes = arenas.bytes;
+    resets = arenas.resets;
+    chunk_mallocs = arenas.chunk_mallocs;
+    for (arena = arenas.list; arena != NULL; arena = arena->next) {
+        allocs += ARENA_GET(arena, allocs);
+        bytes += ARENA_GET(arena, bytes);
+        resets += ARENA_GET(arena, resets);
+        chunk_mallocs += ARENA_GET(arena, chunk_mallocs);
+        reserved += ARENA_GET(arena, reserved);
+    }
+    pthread_mutex_unlock(&arenas.lock);
+    fprintf(fd, "arena: %lu allocs, %lu bytes, %lu resets, %lu chunk mallocs, %lu bytes reserved\n",
+        allocs, bytes, resets, chunk_mallocs, reserved);
+
+    pthread_mutex_lock(&slabs_lock);
+    for (slab = slabs; slab != NULL; slab = slab->next) {
+        pthread_mutex_lock(&slab->lock);
+        capacity = slab->chunks * SLAB_CHUNK;
+        fprintf(fd, "%s_slab: %lu allocs, %lu frees, %lu/%lu objects in use (%lu%% free)\n",
+            slab->name, slab->allocs, slab->frees, slab->in_use, capacity,
+            capacity ? (capacity - slab->in_use) * 100 / capacity : 0);
+        pthread_mutex_unlock(&slab->lock);
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
@@ -0,0 +1,24 @@
+/* Per-thread bump allocator for memory living until the end of the current
+ * FUSE request. REQUEST_ARENA, at the top of a handler, resets it when the
+ * handler returns. */
+void *arena_alloc(size_t size);
+void arena_reset(void);
+void arena_end(int *unused);
+
+#define REQUEST_ARENA int _request_arena __attribute__((cleanup(arena_end), unused)) = 0
+
+/* Pools of fixed-size objects, for long-lived handles and cache entries */
+struct slab {
+    const char *name;
+    size_t size;
+    pthread_mutex_t lock;
+    void *free_list;
+    unsigned long allocs, frees, in_use, chunks;
+    struct slab *next;
+};
+
+void slab_init(struct slab *slab, const char *name, size_t size);
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *object);
+
+void alloc_stats(FILE *fd);
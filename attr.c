@@ -0,0 +1,232 @@
+/* attr.c - path-keyed attributes cache for rewritefs
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "attr.h"
+#include "alloc.h"
+
+struct attr_entry {
+    char *path;
+    unsigned long hash;
+    struct stat st;
+    int missing; /* lstat failed with ENOENT */
+    time_t expires;
+    unsigned long generation; /* of the path when it was read */
+    struct attr_entry *hash_next;
+    struct attr_entry *lru_prev, *lru_next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct attr_entry **buckets;
+    size_t nbuckets, size, max; /* max == 0 disables the cache */
+    int timeout;
+    struct attr_entry *lru_first, *lru_last;
+    unsigned long hits, negative_hits, misses, evictions;
+} attrs = { PTHREAD_MUTEX_INITIALIZER };
+
+/* The generation of a path is the sum of the epoch, bumped by
+ * attr_cache_clear, and of the counter of its stripe, bumped without any
+ * lock by attr_cache_invalidate. Attributes read before a bump aren't
+ * cached after it, and entries cached before it are dropped when found. */
+#define ATTR_STRIPES 1024
+
+static unsigned long epoch, stripes[ATTR_STRIPES];
+
+static struct slab entry_slab;
+
+void attr_cache_init(size_t max, int timeout) {
+    attrs.max = max;
+    attrs.timeout = timeout;
+    if(max == 0)
+        return;
+    for(attrs.nbuckets = 16; attrs.nbuckets < max; attrs.nbuckets *= 2);
+    attrs.buckets = calloc(attrs.nbuckets, sizeof(struct attr_entry *));
+    if(attrs.buckets == NULL) {
+        perror("calloc");
+        abort();
+    }
+    slab_init(&entry_slab, "attr_entry", sizeof(struct attr_entry));
+}
+
+static unsigned long path_hash(const char *path) {
+    unsigned long hash = 14695981039346656037UL;
+
+    for(; *path; path++)
+        hash = (hash ^ (unsigned char)*path) * 1099511628211UL;
+    return hash;
+}
+
+static void lru_unlink(struct attr_entry *entry) {
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        attrs.lru_first = entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        attrs.lru_last = entry->lru_prev;
+}
+
+static void lru_push(struct attr_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = attrs.lru_first;
+    if(attrs.lru_first)
+        attrs.lru_first->lru_prev = entry;
+    else
+        attrs.lru_last = entry;
+    attrs.lru_first = entry;
+}
+
+/* Must be called with attrs.lock held */
+static void remove_entry(struct attr_entry *entry) {
+    struct attr_entry **p;
+
+    for(p = &attrs.buckets[entry->hash & (attrs.nbuckets - 1)]; *p != entry; p = &(*p)->hash_next);
+    *p = entry->hash_next;
+    lru_unlink(entry);
+    free(entry->path);
+    slab_free(&entry_slab, entry);
+    attrs.size--;
+}
+
+/* Must be called with attrs.lock held */
+static struct attr_entry *find_entry(const char *path, unsigned long hash) {
+    struct attr_entry *entry;
+
+    for(entry = attrs.buckets[hash & (attrs.nbuckets - 1)]; entry != NULL; entry = entry->hash_next)
+        if(entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
+    return NULL;
+}
+
+static unsigned long generation(unsigned long hash) {
+    return __atomic_load_n(&epoch, __ATOMIC_ACQUIRE) +
+        __atomic_load_n(&stripes[hash % ATTR_STRIPES], __ATOMIC_ACQUIRE);
+}
+
+/* To be read before looking new_path up, and given to attr_cache_put */
+unsigned long attr_cache_generation(const char *new_path) {
+    return generation(path_hash(new_path));
+}
+
+/* Fill st from the cache and return 0, -ENOENT for a missing file, or
+ * ATTR_MISS */
+int attr_cache_get(const char *new_path, struct stat *st) {
+    struct attr_entry *entry;
+    unsigned long hash;
+    int res = ATTR_MISS;
+
+    if(attrs.max == 0)
+        return ATTR_MISS;
+
+    hash = path_hash(new_path);
+    pthread_mutex_lock(&attrs.lock);
+    entry = find_entry(new_path, hash);
+    if(entry && (entry->expires <= time(NULL) || entry->generation != generation(hash))) {
+        remove_entry(entry);
+        entry = NULL;
+    }
+    if(entry) {
+        if(entry->missing) {
+            res = -ENOENT;
+            attrs.negative_hits++;
+        } else {
+            *st = entry->st;
+            res = 0;
+            attrs.hits++;
+        }
+        lru_unlink(entry);
+        lru_push(entry);
+    } else {
+        attrs.misses++;
+    }
+    pthread_mutex_unlock(&attrs.lock);
+    return res;
+}
+
+/* Cache st, or NULL for a missing file, unless new_path was invalidated
+ * since gen was read */
+void attr_cache_put(const char *new_path, const struct stat *st, unsigned long gen) {
+    struct attr_entry *entry, **b;
+    unsigned long hash;
+
+    if(attrs.max == 0)
+        return;
+
+    hash = path_hash(new_path);
+    pthread_mutex_lock(&attrs.lock);
+    if(gen != generation(hash)) {
+        pthread_mutex_unlock(&attrs.lock);
+        return;
+    }
+    entry = find_entry(new_path, hash);
+    if(entry == NULL) {
+        if(attrs.size >= attrs.max) {
+            remove_entry(attrs.lru_last);
+            attrs.evictions++;
+        }
+        entry = slab_alloc(&entry_slab);
+        if(entry == NULL || (entry->path = strdup(new_path)) == NULL) {
+            if(entry)
+                slab_free(&entry_slab, entry);
+            pthread_mutex_unlock(&attrs.lock);
+            return;
+        }
+        entry->hash = hash;
+        b = &attrs.buckets[hash & (attrs.nbuckets - 1)];
+        entry->hash_next = *b;
+        *b = entry;
+        attrs.size++;
+    } else {
+        lru_unlink(entry);
+    }
+    lru_push(entry);
+    entry->missing = st == NULL;
+    if(st)
+        entry->st = *st;
+    entry->expires = time(NULL) + attrs.timeout;
+    entry->generation = gen;
+    pthread_mutex_unlock(&attrs.lock);
+}
+
+/* Called after each modification: the entry of new_path, and the few
+ * others of its stripe, are dropped when next looked up. Generations are
+ * kept even when the cache is disabled, for -o coalesce. */
+void attr_cache_invalidate(const char *new_path) {
+    __atomic_add_fetch(&stripes[path_hash(new_path) % ATTR_STRIPES], 1, __ATOMIC_RELEASE);
+}
+
+/* Forget everything, when a whole subtree may have changed */
+void attr_cache_clear(void) {
+    __atomic_add_fetch(&epoch, 1, __ATOMIC_RELEASE);
+    if(attrs.max == 0)
+        return;
+
+    pthread_mutex_lock(&attrs.lock);
+    while(attrs.lru_first)
+        remove_entry(attrs.lru_first);
+    pthread_mutex_unlock(&attrs.lock);
+}
+
+void attr_cache_stats(FILE *fd) {
+    if(attrs.max == 0)
+        return;
+
+    pthread_mutex_lock(&attrs.lock);
+    fprintf(fd, "attr_cache: %zu/%zu entries, %lu hits, %lu negative hits, %lu misses, %lu evictions\n",
+        attrs.size, attrs.max, attrs.hits, attrs.negative_hits, attrs.misses, attrs.evictions);
+    pthread_mutex_unlock(&attrs.lock);
+}
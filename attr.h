@@ -0,0 +1,12 @@
+/* Attributes of backing paths, including missing ones, kept for
+ * config.attr_timeout seconds. Modifications made through the mount point
+ * invalidate them; other ones are seen once the entry expires. */
+#define ATTR_MISS 1
+
+void attr_cache_init(size_t max, int timeout);
+unsigned long attr_cache_generation(const char *new_path);
+int attr_cache_get(const char *new_path, struct stat *st);
+void attr_cache_put(const char *new_path, const struct stat *st, unsigned long generation);
+void attr_cache_invalidate(const char *new_path);
+void attr_cache_clear(void);
+void attr_cache_stats(FILE *fd);
@@ -0,0 +1,145 @@
+#!/bin/sh
+# bench.sh - small benchmarks of rewritefs, run from the source directory
+#
+# usage: ./bench.sh SCENARIO [REWRITEFS_OPTIONS]
+#
+# Each scenario mounts ./rewritefs over a scratch directory with its own
+# configuration, prints the time its workload took and the statistics
+# rewritefs dumped, then unmounts. REWRITEFS_OPTIONS (like
+# "-o attr_cache=4096") are added to the mount, so that runs with and
+# without an option can be compared. Needs FUSE and fusermount.
+#
+# Scenarios:
+#   regexp   stat long paths that a nested-quantifier rule fails to match
+#   symlinks resolve paths through a farm of deep symlink chains (compare
+#            with -o readlink_cache=0)
+#   dirs     16 parallel listings of a 100000-entry directory, 5 times
+#            (compare with -o dir_cache=0)
+#   direct   fio --direct=1 random I/O on the original directory, then
+#            through the mount, with the page cache growth of each (needs
+#            fio, and TMPDIR on a filesystem supporting O_DIRECT)
+
+set -e
+
+scenario=$1
+[ -n "$scenario" ] || { sed -n '3,/^$/s/^# \{0,1\}//p' "$0"; exit 1; }
+shift
+
+work=$(mktemp -d)
+src=$work/src
+mnt=$work/mnt
+config=$work/config
+stats=$work/stats
+mkdir "$src" "$mnt"
+
+cleanup() {
+    fusermount -u "$mnt" 2>/dev/null || true
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# the daemon forks, so it is found by its mount point, unique to this run
+mount_fs() {
+    ./rewritefs -o config="$config",stats="$stats" "$@" "$src" "$mnt"
+    pid=$(pgrep -n -f -- "rewritefs .*$mnt")
+}
+
+# only the daemon started here: others may run on the host
+dump_stats() {
+    kill -USR1 "$pid"
+    sleep 1
+    cat "$stats"
+}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# run NAME COMMAND...: time COMMAND
+run() {
+    name=$1
+    shift
+    start=$(now_ms)
+    "$@"
+    echo "$name: $(($(now_ms) - start)) ms"
+}
+
+case $scenario in
+regexp)
+    # a rule that backtracks exponentially on paths not matching it
+    printf '%s\n' 'm#^(\w+\s?)*$# .' 'm#^\.# .config/' > "$config"
+    mount_fs "$@"
+    stat_long() {
+        i=0
+        while [ $i -lt 200 ]; do
+            stat "$mnt/$(printf 'a%.0s' $(seq 1 $((30 + i % 20))))!" >/dev/null 2>&1 || true
+            i=$((i + 1))
+        done
+    }
+    run "200 stats of adversarial paths" stat_long
+    ;;
+symlinks)
+    # 100 chains of 30 symlinks each, ending in a file
+    printf '%s\n' 'm#^\.# .config/' > "$config"
+    i=0
+    while [ $i -lt 100 ]; do
+        mkdir "$src/c$i"
+        touch "$src/c$i/file"
+        ln -s file "$src/c$i/l0"
+        j=1
+        while [ $j -lt 30 ]; do
+            ln -s "l$((j - 1))" "$src/c$i/l$j"
+            j=$((j + 1))
+        done
+        i=$((i + 1))
+    done
+    mount_fs "$@"
+    resolve() {
+        for k in 1 2 3 4 5 6 7 8 9 10; do
+            for d in "$mnt"/c*; do
+                readlink -e "$d/l29" >/dev/null
+            done
+        done
+    }
+    run "30000 symlink resolutions" resolve
+    ;;
+dirs)
+    printf '%s\n' 'm#^\.# .config/' > "$config"
+    mkdir "$src/big"
+    (cd "$src/big" && seq -f 'file-%06g' 1 100000 | xargs touch)
+    sleep 1
+    mount_fs "$@"
+    list_parallel() {
+        for k in 1 2 3 4 5; do
+            for r in $(seq 1 16); do
+                ls -f "$mnt/big" > /dev/null &
+            done
+            wait
+        done
+    }
+    run "80 listings of 100000 entries" list_parallel
+    ;;
+direct)
+    printf '%s\n' 'm#^\.# .config/' > "$config"
+    mount_fs "$@"
+    cached_kb() {
+        sed -n 's/^Cached: *\([0-9]*\) kB/\1/p' /proc/meminfo
+    }
+    fio_direct() {
+        before=$(cached_kb)
+        fio --name=direct --directory="$1" --direct=1 --ioengine=psync \
+            --rw=randrw --bs=128k --size=512m --numjobs=4 --runtime=20 \
+            --time_based --group_reporting | grep -E '^ *(READ|WRITE):'
+        echo "page cache: $(($(cached_kb) - before)) kB"
+        rm -f "$1"/direct.*
+    }
+    run "fio on the original directory" fio_direct "$src"
+    run "fio through rewritefs" fio_direct "$mnt"
+    ;;
+*)
+    echo "unknown scenario $scenario" >&2
+    exit 1
+    ;;
+esac
+
+dump_stats
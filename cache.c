@@ -0,0 +1,266 @@
+/* cache.c - inode-keyed caches for rewritefs
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "alloc.h"
+
+struct cache_entry {
+    dev_t dev;
+    ino_t ino;
+    struct timespec ctime;
+    unsigned long hash;
+    size_t bytes; /* when the cache has max_bytes */
+    void *data;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev, *lru_next;
+};
+
+/* All initialized caches, for cache_stats */
+static struct cache *caches;
+static struct slab entry_slab;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void cache_init(struct cache *cache, const char *name, size_t max, void (*destroy)(void *data)) {
+    cache->name = name;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->size = 0;
+    cache->max = max;
+    cache->lru_first = cache->lru_last = NULL;
+    cache->destroy = destroy;
+    cache->weigh = NULL;
+    cache->bytes = cache->max_bytes = 0;
+    cache->hits = cache->misses = cache->evictions = 0;
+
+    for(cache->nbuckets = 16; cache->nbuckets < max; cache->nbuckets *= 2);
+    cache->buckets = calloc(cache->nbuckets, sizeof(struct cache_entry *));
+    if(cache->buckets == NULL) {
+        perror("calloc");
+        abort();
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    if(caches == NULL)
+        slab_init(&entry_slab, "cache_entry", sizeof(struct cache_entry));
+    cache->next = caches;
+    caches = cache;
+    pthread_mutex_unlock(&caches_lock);
+}
+
+/* Bound the cache to max_bytes too, the data of an entry weighing
+ * weigh(data) bytes */
+void cache_set_max_bytes(struct cache *cache, size_t max_bytes, size_t (*weigh)(void *data)) {
+    cache->max_bytes = max_bytes;
+    cache->weigh = weigh;
+}
+
+static inline unsigned long inode_hash(dev_t dev, ino_t ino) {
+    return dev * 31 + ino;
+}
+
+static inline struct cache_entry **bucket(struct cache *cache, unsigned long hash) {
+    return &cache->buckets[hash & (cache->nbuckets - 1)];
+}
+
+static void lru_unlink(struct cache *cache, struct cache_entry *entry) {
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_first = entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_last = entry->lru_prev;
+}
+
+static void lru_push(struct cache *cache, struct cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_first;
+    if(cache->lru_first)
+        cache->lru_first->lru_prev = entry;
+    else
+        cache->lru_last = entry;
+    cache->lru_first = entry;
+}
+
+/* Must be called with cache->lock held */
+static void remove_entry(struct cache *cache, struct cache_entry *entry) {
+    struct cache_entry **p;
+
+    for(p = bucket(cache, entry->hash); *p != entry; p = &(*p)->hash_next);
+    *p = entry->hash_next;
+    lru_unlink(cache, entry);
+    if(entry->data)
+        cache->destroy(entry->data);
+    cache->bytes -= entry->bytes;
+    slab_free(&entry_slab, entry);
+    cache->size--;
+}
+
+/* Must be called with cache->lock held */
+static struct cache_entry *find_entry(struct cache *cache, dev_t dev, ino_t ino) {
+    struct cache_entry *entry;
+
+    for(entry = *bucket(cache, inode_hash(dev, ino)); entry != NULL; entry = entry->hash_next)
+        if(entry->dev == dev && entry->ino == ino)
+            return entry;
+    return NULL;
+}
+
+/* Add an empty entry, evicting the least recently used one if the cache is
+ * full. Must be called with cache->lock held. */
+static struct cache_entry *new_entry(struct cache *cache, unsigned long hash) {
+    struct cache_entry *entry, **b;
+
+    if(cache->size >= cache->max) {
+        remove_entry(cache, cache->lru_last);
+        cache->evictions++;
+    }
+    entry = slab_alloc(&entry_slab);
+    if(entry == NULL)
+        return NULL;
+    entry->hash = hash;
+    entry->bytes = 0;
+    entry->data = NULL;
+    b = bucket(cache, hash);
+    entry->hash_next = *b;
+    *b = entry;
+    lru_push(cache, entry);
+    cache->size++;
+    return entry;
+}
+
+/* Account for the data of entry once fn changed it, and evict the least
+ * recently used entries while the cache weighs more than max_bytes, entry
+ * last if it is too big alone. Must be called with cache->lock held. */
+static void weigh_entry(struct cache *cache, struct cache_entry *entry) {
+    size_t bytes;
+
+    if(cache->max_bytes == 0)
+        return;
+    bytes = entry->data ? cache->weigh(entry->data) : 0;
+    cache->bytes += bytes - entry->bytes;
+    entry->bytes = bytes;
+    while(cache->bytes > cache->max_bytes && cache->lru_last) {
+        remove_entry(cache, cache->lru_last);
+        cache->evictions++;
+    }
+}
+
+/* Whether the file st may change again without its ctime changing. ctimes
+ * come from a clock ticking every few milliseconds, or every second on
+ * filesystems with whole-second timestamps, which leave tv_nsec to 0. */
+int cache_recent(const struct stat *st) {
+    struct timespec now;
+    long long ms;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if(st->st_ctim.tv_nsec == 0)
+        return st->st_ctim.tv_sec >= now.tv_sec - 1;
+    ms = (now.tv_sec - st->st_ctim.tv_sec) * 1000LL + (now.tv_nsec - st->st_ctim.tv_nsec) / 1000000;
+    return ms < CACHE_RECENT_MS;
+}
+
+static inline int same_ctime(const struct cache_entry *entry, const struct stat *st) {
+    return entry->ctime.tv_sec == st->st_ctim.tv_sec && entry->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Call fn on the data cached for st and return its result, or CACHE_MISS if
+ * there is no up-to-date entry */
+int cache_get(struct cache *cache, const struct stat *st, int (*fn)(void *data, void *arg), void *arg) {
+    struct cache_entry *entry;
+    int res = CACHE_MISS;
+
+    if(cache->max == 0)
+        return CACHE_MISS;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = find_entry(cache, st->st_dev, st->st_ino);
+    if(entry && !same_ctime(entry, st)) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if(entry && entry->data) {
+        res = fn(entry->data, arg);
+        lru_unlink(cache, entry);
+        lru_push(cache, entry);
+    }
+    if(res == CACHE_MISS)
+        cache->misses++;
+    else
+        cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return res;
+}
+
+/* Let fn create or update the data cached for st. Recently changed files
+ * are not cached: the ctime granularity could hide a later change. */
+void cache_put(struct cache *cache, const struct stat *st, void (*fn)(void **data, void *arg), void *arg) {
+    struct cache_entry *entry;
+
+    if(cache->max == 0 || cache_recent(st))
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = find_entry(cache, st->st_dev, st->st_ino);
+    if(entry && !same_ctime(entry, st)) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+    if(entry == NULL) {
+        entry = new_entry(cache, inode_hash(st->st_dev, st->st_ino));
+        if(entry == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+        entry->dev = st->st_dev;
+        entry->ino = st->st_ino;
+        entry->ctime = st->st_ctim;
+    } else {
+        lru_unlink(cache, entry);
+        lru_push(cache, entry);
+    }
+    fn(&entry->data, arg);
+    weigh_entry(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_invalidate(struct cache *cache, dev_t dev, ino_t ino) {
+    struct cache_entry *entry;
+
+    if(cache->max == 0)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = find_entry(cache, dev, ino);
+    if(entry)
+        remove_entry(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_stats(FILE *fd) {
+    struct cache *cache;
+
+    pthread_mutex_lock(&caches_lock);
+    for(cache = caches; cache != NULL; cache = cache->next) {
+        pthread_mutex_lock(&cache->lock);
+        fprintf(fd, "%s_cache: %zu/%zu entries, ", cache->name, cache->size, cache->max);
+        if(cache->max_bytes)
+            fprintf(fd, "%zu/%zu bytes, ", cache->bytes, cache->max_bytes);
+        fprintf(fd, "%lu hits, %lu misses, %lu evictions\n", cache->hits, cache->misses, cache->evictions);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
@@ -0,0 +1,31 @@
+/* Bounded LRU caches of per-file data, keyed by backing inode and
+ * validated against its ctime */
+#define CACHE_MISS INT_MIN
+
+/* Files changed less than this ago aren't cached by inode, on filesystems
+ * with sub-second timestamps */
+#define CACHE_RECENT_MS 50
+
+struct cache_entry;
+
+struct cache {
+    const char *name;
+    pthread_mutex_t lock;
+    struct cache_entry **buckets;
+    size_t nbuckets;
+    size_t size, max; /* max == 0 disables the cache */
+    struct cache_entry *lru_first, *lru_last;
+    void (*destroy)(void *data);
+    size_t (*weigh)(void *data);
+    size_t bytes, max_bytes; /* max_bytes == 0: no limit */
+    unsigned long hits, misses, evictions;
+    struct cache *next;
+};
+
+void cache_init(struct cache *cache, const char *name, size_t max, void (*destroy)(void *data));
+void cache_set_max_bytes(struct cache *cache, size_t max_bytes, size_t (*weigh)(void *data));
+int cache_recent(const struct stat *st);
+int cache_get(struct cache *cache, const struct stat *st, int (*fn)(void *data, void *arg), void *arg);
+void cache_put(struct cache *cache, const struct stat *st, void (*fn)(void **data, void *arg), void *arg);
+void cache_invalidate(struct cache *cache, dev_t dev, ino_t ino);
+void cache_stats(FILE *fd);
@@ -0,0 +1,414 @@
+/* cachesim.c - replay a rewritefs trace against simulated caches
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * usage: cachesim [-s SIZES] [-t TTLS] TRACE
+ *
+ * Reads a trace recorded with -o trace=FILE (see trace.h) and replays it
+ * against LRU caches of each of SIZES entries and, for the caches that can
+ * go stale, each of TTLS seconds (0: no expiry). For each configuration,
+ * prints the hit rate and the rewrite and system call time that would have
+ * been saved. Simulated caches:
+ *
+ *   rewrite   rewritten path by (caller, path)
+ *   caller    contexts matching the command line, by pid
+ *   attr      getattr results by path, dropped when the path is modified
+ *   negative  the same, for ENOENT results only
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define DEFAULT_SIZES "64,256,1024,4096,16384,65536"
+#define DEFAULT_TTLS "1,10,60,0"
+
+struct event {
+    char type; /* R, A or M */
+    int err; /* A */
+    int subtree; /* M: drops the entries below path too */
+    unsigned long time, pid, caller, caller_usec, rewrite_usec, syscall_usec;
+    char *key; /* R: "caller path"; A, M: path */
+};
+
+static struct event *events;
+static size_t nevents, events_cap;
+
+/*
+ * Simulated LRU cache of string keys
+ */
+struct entry {
+    char *key;
+    unsigned long value;
+    unsigned long expires; /* 0: never */
+    struct entry *hnext, *prev, *next;
+};
+
+struct sim {
+    struct entry **buckets;
+    size_t nbuckets, size, max;
+    struct entry *first, *last;
+};
+
+static unsigned long hash(const char *s) {
+    unsigned long h = 14695981039346656037UL;
+    for(; *s; s++)
+        h = (h ^ (unsigned char)*s) * 1099511628211UL;
+    return h;
+}
+
+static void *xcalloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if(p == NULL) {
+        perror("calloc");
+        abort();
+    }
+    return p;
+}
+
+static void sim_init(struct sim *sim, size_t max) {
+    memset(sim, 0, sizeof(*sim));
+    sim->max = max;
+    for(sim->nbuckets = 16; sim->nbuckets < max * 2; sim->nbuckets *= 2);
+    sim->buckets = xcalloc(sim->nbuckets, sizeof(struct entry *));
+}
+
+static void sim_unlink(struct sim *sim, struct entry *e) {
+    struct entry **p;
+
+    for(p = &sim->buckets[hash(e->key) & (sim->nbuckets - 1)]; *p != e; p = &(*p)->hnext);
+    *p = e->hnext;
+    if(e->prev) e->prev->next = e->next; else sim->first = e->next;
+    if(e->next) e->next->prev = e->prev; else sim->last = e->prev;
+    sim->size--;
+    free(e->key);
+    free(e);
+}
+
+static void sim_free(struct sim *sim) {
+    while(sim->first)
+        sim_unlink(sim, sim->first);
+    free(sim->buckets);
+}
+
+/* The live entry for key, moved to the front, or NULL */
+static struct entry *sim_get(struct sim *sim, const char *key, unsigned long now) {
+    struct entry *e;
+
+    for(e = sim->buckets[hash(key) & (sim->nbuckets - 1)]; e; e = e->hnext)
+        if(strcmp(e->key, key) == 0)
+            break;
+    if(e == NULL)
+        return NULL;
+    if(e->expires && e->expires <= now) {
+        sim_unlink(sim, e);
+        return NULL;
+    }
+    if(e != sim->first) {
+        e->prev->next = e->next;
+        if(e->next) e->next->prev = e->prev; else sim->last = e->prev;
+        e->prev = NULL;
+        e->next = sim->first;
+        sim->first->prev = e;
+        sim->first = e;
+    }
+    return e;
+}
+
+static void sim_put(struct sim *sim, const char *key, unsigned long value, unsigned long now, unsigned long ttl) {
+    struct entry *e = sim_get(sim, key, now), **bucket;
+
+    if(e == NULL) {
+        if(sim->size == sim->max)
+            sim_unlink(sim, sim->last);
+        e = xcalloc(1, sizeof(*e));
+        e->key = strdup(key);
+        if(e->key == NULL) {
+            perror("strdup");
+            abort();
+        }
+        bucket = &sim->buckets[hash(key) & (sim->nbuckets - 1)];
+        e->hnext = *bucket;
+        *bucket = e;
+        e->next = sim->first;
+        if(sim->first) sim->first->prev = e; else sim->last = e;
+        sim->first = e;
+        sim->size++;
+    }
+    e->value = value;
+    e->expires = ttl ? now + ttl * 1000000 : 0;
+}
+
+/* Drop key and, for subtree, every key below it */
+static void sim_drop(struct sim *sim, const char *key, int subtree) {
+    struct entry *e, *next;
+    size_t len = strlen(key);
+
+    if(!subtree) {
+        if((e = sim_get(sim, key, 0)))
+            sim_unlink(sim, e);
+        return;
+    }
+    for(e = sim->first; e; e = next) {
+        next = e->next;
+        if(strncmp(e->key, key, len) == 0 && (e->key[len] == 0 || e->key[len] == '/'))
+            sim_unlink(sim, e);
+    }
+}
+
+/*
+ * Simulations
+ */
+struct result {
+    unsigned long lookups, hits, stale, saved_usec;
+};
+
+static void sim_rewrite(struct sim *sim, unsigned long ttl, struct result *r) {
+    size_t i;
+    struct event *ev;
+
+    for(i = 0; i < nevents; i++) {
+        ev = &events[i];
+        if(ev->type != 'R')
+            continue;
+        r->lookups++;
+        if(sim_get(sim, ev->key, ev->time)) {
+            r->hits++;
+            /* a request which shared the rewrite of another one reports
+             * the caller_usec of that one, maybe more than it waited */
+            if(ev->rewrite_usec > ev->caller_usec)
+                r->saved_usec += ev->rewrite_usec - ev->caller_usec;
+        } else {
+            sim_put(sim, ev->key, 0, ev->time, ttl);
+        }
+    }
+}
+
+static void sim_caller(struct sim *sim, unsigned long ttl, struct result *r) {
+    size_t i;
+    struct event *ev;
+    struct entry *e;
+    char key[32];
+
+    for(i = 0; i < nevents; i++) {
+        ev = &events[i];
+        if(ev->type != 'R' || ev->caller == 0)
+            continue;
+        r->lookups++;
+        snprintf(key, sizeof(key), "%lu", ev->pid);
+        e = sim_get(sim, key, ev->time);
+        if(e && e->value == ev->caller) {
+            r->hits++;
+            r->saved_usec += ev->caller_usec;
+            continue;
+        }
+        /* a recycled pid: the cache would have given a wrong answer */
+        if(e)
+            r->stale++;
+        sim_put(sim, key, ev->caller, ev->time, ttl);
+    }
+}
+
+static void sim_attrs(struct sim *sim, unsigned long ttl, int negative, struct result *r) {
+    size_t i;
+    struct event *ev;
+    struct entry *e;
+
+    for(i = 0; i < nevents; i++) {
+        ev = &events[i];
+        if(ev->type == 'M') {
+            sim_drop(sim, ev->key, ev->subtree);
+            continue;
+        }
+        if(ev->type != 'A')
+            continue;
+        r->lookups++;
+        if((e = sim_get(sim, ev->key, ev->time))) {
+            r->hits++;
+            r->saved_usec += ev->rewrite_usec + ev->syscall_usec;
+            /* changed outside of the mount point */
+            if(e->value != (unsigned long) ev->err)
+                r->stale++;
+        } else if(!negative || ev->err == ENOENT) {
+            sim_put(sim, ev->key, ev->err, ev->time, ttl);
+        }
+    }
+}
+
+static void sim_attr(struct sim *sim, unsigned long ttl, struct result *r) {
+    sim_attrs(sim, ttl, 0, r);
+}
+
+static void sim_negative(struct sim *sim, unsigned long ttl, struct result *r) {
+    sim_attrs(sim, ttl, 1, r);
+}
+
+/*
+ * Trace parsing and report
+ */
+static void add_event(struct event *ev) {
+    if(nevents == events_cap) {
+        events_cap = events_cap ? events_cap * 2 : 4096;
+        events = realloc(events, events_cap * sizeof(struct event));
+        if(events == NULL) {
+            perror("realloc");
+            abort();
+        }
+    }
+    events[nevents++] = *ev;
+}
+
+static void load_trace(FILE *fd) {
+    char *line = NULL, op[16];
+    size_t cap = 0;
+    ssize_t len;
+    int n, lineno = 0;
+    struct event ev;
+
+    while((len = getline(&line, &cap, fd)) != -1) {
+        lineno++;
+        if(len > 0 && line[len - 1] == '\n')
+            line[--len] = 0;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = line[0];
+        n = -1;
+        switch(ev.type) {
+        case 'R':
+            sscanf(line, "R %lu %lu %lx %lu %lu %n", &ev.time, &ev.pid, &ev.caller,
+                &ev.caller_usec, &ev.rewrite_usec, &n);
+            if(n > 0 && asprintf(&ev.key, "%lx %s", ev.caller, line + n) == -1)
+                ev.key = NULL;
+            break;
+        case 'A':
+            sscanf(line, "A %lu %d %lu %lu %n", &ev.time, &ev.err, &ev.rewrite_usec,
+                &ev.syscall_usec, &n);
+            if(n > 0)
+                ev.key = strdup(line + n);
+            break;
+        case 'M':
+            sscanf(line, "M %lu %15s %n", &ev.time, op, &n);
+            ev.subtree = n > 0 && (strcmp(op, "rename") == 0 || strcmp(op, "rmdir") == 0);
+            if(n > 0)
+                ev.key = strdup(line + n);
+            break;
+        }
+        if(n <= 0 || ev.key == NULL) {
+            fprintf(stderr, "WARNING: ignoring invalid trace line %d\n", lineno);
+            continue;
+        }
+        add_event(&ev);
+    }
+    free(line);
+}
+
+static size_t parse_list(const char *s, unsigned long *list, size_t max) {
+    size_t n = 0;
+    char *end;
+
+    while(n < max) {
+        list[n++] = strtoul(s, &end, 10);
+        if(end == s || (*end != ',' && *end != 0)) {
+            fprintf(stderr, "Invalid list: %s\n", s);
+            exit(1);
+        }
+        if(*end == 0)
+            break;
+        s = end + 1;
+    }
+    return n;
+}
+
+/* Run sim for every size, and every TTL when use_ttl */
+static void report(const char *name, void (*run)(struct sim *, unsigned long, struct result *),
+        int use_ttl, unsigned long *sizes, size_t nsizes, unsigned long *ttls, size_t nttls) {
+    size_t i, j;
+    struct sim sim;
+    struct result r;
+
+    printf("%s cache:\n", name);
+    printf("  %8s %6s %7s %12s %8s\n", "size", use_ttl ? "ttl" : "", "hit%", "saved_usec", "stale");
+    for(i = 0; i < nsizes; i++) {
+        for(j = 0; j < (use_ttl ? nttls : 1); j++) {
+            memset(&r, 0, sizeof(r));
+            sim_init(&sim, sizes[i]);
+            run(&sim, use_ttl ? ttls[j] : 0, &r);
+            sim_free(&sim);
+            if(use_ttl)
+                printf("  %8lu %6lu", sizes[i], ttls[j]);
+            else
+                printf("  %8lu %6s", sizes[i], "");
+            printf(" %6.1f%% %12lu %8lu\n", r.lookups ? 100.0 * r.hits / r.lookups : 0.0,
+                r.saved_usec, r.stale);
+        }
+    }
+    printf("\n");
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-s SIZES] [-t TTLS] TRACE\n"
+            "\n"
+            "    -s SIZES   comma-separated cache sizes, in entries [%s]\n"
+            "    -t TTLS    comma-separated TTLs, in seconds, 0 for none [%s]\n",
+            name, DEFAULT_SIZES, DEFAULT_TTLS);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long sizes[64], ttls[64], rewrite_usec = 0, syscall_usec = 0;
+    size_t nsizes, nttls, i, rewrites = 0, getattrs = 0, mutations = 0;
+    const char *size_list = DEFAULT_SIZES, *ttl_list = DEFAULT_TTLS;
+    FILE *fd;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:t:h")) != -1) {
+        switch(opt) {
+        case 's': size_list = optarg; break;
+        case 't': ttl_list = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if(optind != argc - 1)
+        usage(argv[0]);
+    nsizes = parse_list(size_list, sizes, 64);
+    nttls = parse_list(ttl_list, ttls, 64);
+    for(i = 0; i < nsizes; i++) {
+        if(sizes[i] == 0) {
+            fprintf(stderr, "Cache sizes must be positive\n");
+            exit(1);
+        }
+    }
+
+    fd = fopen(argv[optind], "r");
+    if(fd == NULL) {
+        perror("opening trace file");
+        exit(1);
+    }
+    load_trace(fd);
+    fclose(fd);
+
+    for(i = 0; i < nevents; i++) {
+        switch(events[i].type) {
+        case 'R': rewrites++; rewrite_usec += events[i].rewrite_usec; break;
+        case 'A': getattrs++; syscall_usec += events[i].syscall_usec; break;
+        case 'M': mutations++; break;
+        }
+    }
+    printf("%zu rewrites (%lu usec), %zu getattrs (%lu usec in lstat), %zu modifications\n\n",
+        rewrites, rewrite_usec, getattrs, syscall_usec, mutations);
+
+    report("rewrite", sim_rewrite, 0, sizes, nsizes, ttls, nttls);
+    report("caller", sim_caller, 1, sizes, nsizes, ttls, nttls);
+    report("attr", sim_attr, 1, sizes, nsizes, ttls, nttls);
+    report("negative", sim_negative, 1, sizes, nsizes, ttls, nttls);
+
+    for(i = 0; i < nevents; i++)
+        free(events[i].key);
+    free(events);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/* check.c - regression checks of rewrite.c, run by "make check"
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#include "rewrite.c"
+
+/* Context regexps and a command line each matches: the literal the
+ * prefilter requires must be in it, or the context would be skipped */
+static const struct {
+    const char *pattern;
+    int flags;
+    const char *cmdline;
+} literal_checks[] = {
+    { "^\\S*busybox", 0, "/bin/busybox sh" },
+    { "\\bvim\\b", 0, "vim notes" },
+    { "foo(bar)?baz", 0, "foobaz" },
+    { "FireFox", PCRE_CASELESS, "/usr/lib/firefox/firefox" },
+    { "abcx*yz", 0, "abcyz" },
+    { "abc{2}d", 0, "abccd" },
+    { "\\x41BCD", 0, "ABCD" },
+    { "--profile[= ]work", 0, "app --profile work" },
+    { "a\\.b\\.c", 0, "a.b.c" },
+    { "\\d+python3", 0, "3python3" },
+    { "[[:alpha:]]foo", 0, "xfoo" },
+    { "[^[:space:]]]bar", 0, "x]bar" },
+    { "(?<n>a)\\k<n>bcd", 0, "aabcd" },
+    { "(?<n>a)\\k{n}bcd", 0, "aabcd" },
+    { "(?<n>a)\\k'n'bcd", 0, "aabcd" },
+    { "(a)\\g{1}bcd", 0, "aabcd" },
+    { "(a)\\g{-1}bcd", 0, "aabcd" },
+    { "(a)\\g-1bcd", 0, "aabcd" },
+    { "\\o{141}bcd", 0, "abcd" },
+    { "abc\xc3\xa9?", PCRE_UTF8, "abc" },
+    { "abc\xc3\xa9{2}", PCRE_UTF8, "abc\xc3\xa9\xc3\xa9" },
+};
+
+static int check_literals(void) {
+    struct regexp regexp;
+    const char *error;
+    char literal[256], lower[256];
+    int i, j, len, failed = 0;
+
+    for(i = 0; i < (int)(sizeof(literal_checks) / sizeof(literal_checks[0])); i++) {
+        memset(&regexp, 0, sizeof(regexp));
+        regexp.raw = (char *) literal_checks[i].pattern;
+        regexp.flags = literal_checks[i].flags;
+        if((error = regexp_compile(&regexp)) != NULL) {
+            printf("FAIL %s: %s\n", regexp.raw, error);
+            failed++;
+            continue;
+        }
+        if(regexp_exec(&regexp, literal_checks[i].cmdline, strlen(literal_checks[i].cmdline), NULL, 0) < 0) {
+            printf("FAIL %s: doesn't match \"%s\"\n", regexp.raw, literal_checks[i].cmdline);
+            failed++;
+            continue;
+        }
+        len = required_literal(&regexp, literal, sizeof(literal) - 1);
+        literal[len] = 0;
+        for(j = 0; literal_checks[i].cmdline[j] && j < (int)sizeof(lower) - 1; j++)
+            lower[j] = tolower((unsigned char)literal_checks[i].cmdline[j]);
+        lower[j] = 0;
+        if(len > 0 && strstr(lower, literal) == NULL) {
+            printf("FAIL %s: requires \"%s\", missing from \"%s\"\n", regexp.raw, literal, literal_checks[i].cmdline);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+int main(void) {
+    int failed;
+
+    config.match_limit = MATCH_LIMIT;
+    config.match_limit_recursion = MATCH_LIMIT_RECURSION;
+    failed = check_literals();
+    printf("%d failed\n", failed);
+    return failed != 0;
+}
@@ -0,0 +1,130 @@
+/* flight.c - deduplication of concurrent identical lookups
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "flight.h"
+
+struct flight {
+    char *key;
+    int done;
+    int refs; /* the computing thread and the waiting ones */
+    void *result;
+    size_t size;
+    pthread_cond_t cond;
+    struct flight *next;
+};
+
+/* All initialized groups, for flight_stats */
+static struct flight_group *groups;
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void flight_init(struct flight_group *group, const char *name) {
+    group->name = name;
+    pthread_mutex_init(&group->lock, NULL);
+    group->flights = NULL;
+    group->calls = group->coalesced = 0;
+
+    pthread_mutex_lock(&groups_lock);
+    group->next = groups;
+    groups = group;
+    pthread_mutex_unlock(&groups_lock);
+}
+
+/* Must be called with group->lock held */
+static void *flight_leave(struct flight *flight) {
+    void *copy = NULL;
+
+    if(flight->result) {
+        copy = malloc(flight->size);
+        if(copy)
+            memcpy(copy, flight->result, flight->size);
+    }
+    if(--flight->refs == 0) {
+        pthread_cond_destroy(&flight->cond);
+        free(flight->result);
+        free(flight->key);
+        free(flight);
+    }
+    return copy;
+}
+
+/* Return fn(arg), which returns malloc'd memory of *size bytes or NULL,
+ * computed either by this thread or by a concurrent one called with the
+ * same key. The result is malloc'd, and freed by the caller. */
+void *flight_do(struct flight_group *group, const char *key,
+        void *(*fn)(void *arg, size_t *size), void *arg) {
+    struct flight *flight, **p;
+    void *result, *copy;
+    size_t size = 0;
+
+    pthread_mutex_lock(&group->lock);
+    group->calls++;
+    for(flight = group->flights; flight != NULL; flight = flight->next)
+        if(strcmp(flight->key, key) == 0)
+            break;
+    if(flight) {
+        group->coalesced++;
+        flight->refs++;
+        while(!flight->done)
+            pthread_cond_wait(&flight->cond, &group->lock);
+        copy = flight_leave(flight);
+        pthread_mutex_unlock(&group->lock);
+        return copy;
+    }
+
+    flight = calloc(1, sizeof(*flight));
+    if(flight == NULL || (flight->key = strdup(key)) == NULL) {
+        /* do it alone */
+        pthread_mutex_unlock(&group->lock);
+        free(flight);
+        return fn(arg, &size);
+    }
+    flight->refs = 1;
+    pthread_cond_init(&flight->cond, NULL);
+    flight->next = group->flights;
+    group->flights = flight;
+    pthread_mutex_unlock(&group->lock);
+
+    result = fn(arg, &size);
+
+    pthread_mutex_lock(&group->lock);
+    for(p = &group->flights; *p != flight; p = &(*p)->next);
+    *p = flight->next;
+    flight->done = 1;
+    if(flight->refs == 1) {
+        /* nobody waited, and nobody can find it any more */
+        pthread_mutex_unlock(&group->lock);
+        pthread_cond_destroy(&flight->cond);
+        free(flight->key);
+        free(flight);
+        return result;
+    }
+    flight->result = result;
+    flight->size = size;
+    pthread_cond_broadcast(&flight->cond);
+    copy = flight_leave(flight);
+    pthread_mutex_unlock(&group->lock);
+    return copy;
+}
+
+void flight_stats(FILE *fd) {
+    struct flight_group *group;
+
+    pthread_mutex_lock(&groups_lock);
+    for(group = groups; group != NULL; group = group->next) {
+        pthread_mutex_lock(&group->lock);
+        fprintf(fd, "%s_flights: %lu calls, %lu coalesced\n",
+            group->name, group->calls, group->coalesced);
+        pthread_mutex_unlock(&group->lock);
+    }
+    pthread_mutex_unlock(&groups_lock);
+}
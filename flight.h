@@ -0,0 +1,16 @@
+/* Single-flight: concurrent calls with the same key share one computation
+ * instead of each doing it */
+struct flight;
+
+struct flight_group {
+    const char *name;
+    pthread_mutex_t lock;
+    struct flight *flights; /* in progress, as many as busy threads */
+    unsigned long calls, coalesced;
+    struct flight_group *next;
+};
+
+void flight_init(struct flight_group *group, const char *name);
+void *flight_do(struct flight_group *group, const char *key,
+        void *(*fn)(void *arg, size_t *size), void *arg);
+void flight_stats(FILE *fd);
@@ -0,0 +1,174 @@
+/* mkmap.c - build a static map for "= FILE" rules
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ *
+ * usage: mkmap OUTPUT [INPUT]
+ *
+ * Reads lines "path<TAB>rewritten-path" from INPUT (default: standard
+ * input), both relative to the mount point and to the source directory,
+ * and writes their index to OUTPUT (see staticmap.h). OUTPUT is replaced
+ * atomically, so that it can be rebuilt while mounted ; the new table is used
+ * from the next mount.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "staticmap.h"
+
+struct entry {
+    char *key, *value;
+    size_t key_len, value_len;
+    uint64_t hash;
+};
+
+static struct entry *entries;
+static size_t count, cap;
+
+static void *xrealloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if(p == NULL) {
+        perror("realloc");
+        abort();
+    }
+    return p;
+}
+
+static void read_entries(FILE *fd) {
+    char *line = NULL, *tab;
+    size_t line_cap = 0;
+    ssize_t len;
+    int lineno = 0;
+    struct entry *e;
+
+    while((len = getline(&line, &line_cap, fd)) != -1) {
+        lineno++;
+        if(len > 0 && line[len - 1] == '\n')
+            line[--len] = 0;
+        if(len == 0)
+            continue;
+        tab = strchr(line, '\t');
+        if(tab == NULL) {
+            fprintf(stderr, "line %d: missing tab\n", lineno);
+            exit(1);
+        }
+        *tab = 0;
+        if(count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            entries = xrealloc(entries, cap * sizeof(struct entry));
+        }
+        e = &entries[count++];
+        /* rules match paths without their leading / */
+        e->key = strdup(line[0] == '/' ? line + 1 : line);
+        e->value = strdup(tab[1] == '/' ? tab + 2 : tab + 1);
+        if(e->key == NULL || e->value == NULL) {
+            perror("strdup");
+            abort();
+        }
+        e->key_len = strlen(e->key);
+        e->value_len = strlen(e->value);
+        e->hash = staticmap_hash(e->key, e->key_len);
+    }
+    free(line);
+}
+
+int main(int argc, char *argv[]) {
+    struct staticmap_header header;
+    struct staticmap_bucket *buckets;
+    struct staticmap_record record;
+    uint64_t nbuckets, mask, i, offset;
+    size_t j, *slots, size, duplicates = 0;
+    char *kept, *tmp;
+    static const char padding[STATICMAP_ALIGN];
+    FILE *in = stdin, *out;
+    int fd;
+
+    if(argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s OUTPUT [INPUT]\n", argv[0]);
+        exit(1);
+    }
+    if(argc == 3 && (in = fopen(argv[2], "r")) == NULL) {
+        perror("opening input");
+        exit(1);
+    }
+    read_entries(in);
+
+    /* at most half full, so that probe sequences stay short */
+    for(nbuckets = 16; nbuckets < 2 * (uint64_t) count; nbuckets *= 2);
+    mask = nbuckets - 1;
+    buckets = calloc(nbuckets, sizeof(struct staticmap_bucket));
+    slots = calloc(nbuckets, sizeof(size_t)); /* entry of each bucket */
+    kept = calloc(count + 1, 1);
+    if(buckets == NULL || slots == NULL || kept == NULL) {
+        perror("calloc");
+        abort();
+    }
+
+    offset = sizeof(header) + nbuckets * sizeof(struct staticmap_bucket);
+    for(j = 0; j < count; j++) {
+        for(i = entries[j].hash & mask; buckets[i].offset; i = (i + 1) & mask) {
+            if(buckets[i].hash == entries[j].hash && !strcmp(entries[slots[i]].key, entries[j].key))
+                break;
+        }
+        if(buckets[i].offset) {
+            fprintf(stderr, "WARNING: duplicate path \"%s\", keeping the first one\n", entries[j].key);
+            duplicates++;
+            continue;
+        }
+        kept[j] = 1;
+        slots[i] = j;
+        buckets[i].hash = entries[j].hash;
+        buckets[i].offset = offset;
+        size = sizeof(record) + entries[j].key_len + entries[j].value_len + 2;
+        offset += (size + STATICMAP_ALIGN - 1) & ~(size_t) (STATICMAP_ALIGN - 1);
+    }
+
+    if(asprintf(&tmp, "%s.XXXXXX", argv[1]) == -1) {
+        perror("malloc");
+        abort();
+    }
+    fd = mkstemp(tmp);
+    if(fd == -1 || (out = fdopen(fd, "w")) == NULL) {
+        perror("creating output");
+        exit(1);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATICMAP_MAGIC, 8);
+    header.byte_order = STATICMAP_BYTE_ORDER;
+    header.version = STATICMAP_VERSION;
+    header.nbuckets = nbuckets;
+    header.count = count - duplicates;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(buckets, sizeof(struct staticmap_bucket), nbuckets, out);
+    for(j = 0; j < count; j++) {
+        if(!kept[j])
+            continue;
+        record.key_len = entries[j].key_len;
+        record.value_len = entries[j].value_len;
+        fwrite(&record, sizeof(record), 1, out);
+        fwrite(entries[j].key, 1, entries[j].key_len + 1, out);
+        fwrite(entries[j].value, 1, entries[j].value_len + 1, out);
+        size = sizeof(record) + entries[j].key_len + entries[j].value_len + 2;
+        fwrite(padding, 1, ((size + STATICMAP_ALIGN - 1) & ~(size_t) (STATICMAP_ALIGN - 1)) - size, out);
+    }
+    if(fchmod(fd, 0644) == -1 || fflush(out) == EOF || ferror(out) || fsync(fd) == -1 ||
+            fclose(out) == EOF || rename(tmp, argv[1]) == -1) {
+        perror("writing output");
+        unlink(tmp);
+        exit(1);
+    }
+    printf("%zu entries, %lu buckets, %lu bytes\n", count - duplicates,
+        (unsigned long) nbuckets, (unsigned long) offset);
+    free(buckets);
+    free(slots);
+    free(kept);
+    free(tmp);
+    return 0;
+}
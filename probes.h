@@ -0,0 +1,39 @@
+/* USDT probes, compiled in with "make USDT=1" (needs sys/sdt.h, from
+ * systemtap-sdt-dev or systemtap-sdt-devel). A probe is a nop until a
+ * tracer attaches to it, so they can stay in production builds:
+ *
+ *   bpftrace -l 'usdt:/usr/local/bin/rewritefs:*'
+ *
+ *   op__entry(op), op__exit(op)
+ *       a FUSE handler, op being its name like "rewrite_getattr"
+ *   rewrite__start(path), rewrite__end(path, rewritten)
+ *   caller__fetch(pid, cmdline)
+ *       /proc/pid/cmdline read for context matching
+ *   context__match(regexp, matched)
+ *   rule__match(rule, path)
+ *       the first rule matching path; rule is its regexp or "= FILE"
+ *   lock__wait(write), lock__acquire(write)
+ *       before and after taking the lock around backing syscalls
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(rewritefs, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(rewritefs, name, a, b)
+
+static inline const char *op_probe_entry(const char *op) {
+    PROBE1(op__entry, op);
+    return op;
+}
+
+static inline void op_probe_exit(const char **op) {
+    PROBE1(op__exit, *op);
+}
+
+/* At the top of a handler, fires op__entry, and op__exit when it returns */
+#define OP_PROBE const char *_op_probe __attribute__((cleanup(op_probe_exit), unused)) = op_probe_entry(__func__)
+#else
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define OP_PROBE int _op_probe __attribute__((unused))
+#endif
@@ -8,14 +8,40 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include <fuse.h>
 #include <fuse_opt.h>
 #include <pcre.h>
 
 #include "rewrite.h"
+#include "stats.h"
+#include "alloc.h"
+#include "trace.h"
+#include "flight.h"
+#include "staticmap.h"
+#include "account.h"
+#include "probes.h"
 
-#define DEBUG(lvl, x...) if(config.verbose >= lvl) fprintf(stderr, x)
+/* Defaults for the per-regexp pcre_exec budget */
+#define MATCH_LIMIT 1000000
+#define MATCH_LIMIT_RECURSION 50000
+
+/* Default number of inodes in each cache */
+#define CACHE_SIZE 4096
+
+/* Default number of cached directory listings, which can be large */
+#define DIR_CACHE_SIZE 256
+#define DIR_CACHE_MB 64
+
+/* Default lifetime of cached attributes, in seconds */
+#define ATTR_TIMEOUT 1
+
+/* Default lifetime of statfs results, in seconds */
+#define STATFS_TTL 1
 
 /*
  * Type definiton 
@@ -24,39 +50,44 @@ struct regexp {
     pcre *regexp;
     pcre_extra *extra;
     int captures;
+    int flags;
+    int compiled; /* regexp, extra and captures are set, even if NULL */
+    unsigned long limit_hits;
     char *raw;
 };
 
 struct rewrite_rule {
-    struct regexp *filename_regexp;
+    struct regexp *filename_regexp; /* NULL for static maps */
+    struct staticmap *map;
     char *rewritten_path; /* NULL for "." */
+    unsigned long hits;
     struct rewrite_rule *next;
 };
 
 struct rewrite_context {
     struct regexp *cmdline; /* NULL for all contexts */
+    int index; /* literal in config.cmdlines, 0 if always matched */
     struct rewrite_rule *rules;
     struct rewrite_context *next;
 };
 
-struct config {
-    char *config_file;
-    char *orig_fs;
-    char *mount_point;
-    struct rewrite_context *contexts;
-    int verbose;
-};
-
 enum type {
     CMDLINE,
     RULE,
+    MAP,
     END
 };
 
 /*
  * Global variables
  */
-static struct config config;
+struct config config;
+
+/* Single-flight groups, with -o coalesce */
+static struct flight_group caller_flights, rewrite_flights;
+
+/* Whether the result of rewrite depends on the caller */
+static int has_cmdlines;
 
 /*
  * Config-file parsing
@@ -93,6 +124,12 @@ static void string_append(char **string, char c, int *string_cap, int *string_si
     (*string)[*string_size] = 0;
 }
 
+/* append s to string */
+static void string_concat(char **string, const char *s, int *string_cap, int *string_size) {
+    while(*s)
+        string_append(string, *s++, string_cap, string_size);
+}
+
 /* Consume the string until reaching sep */
 static void parse_string(FILE *fd, char **string, char sep) {
     int string_cap = 255;
@@ -130,12 +167,401 @@ static void parse_string(FILE *fd, char **string, char sep) {
     }
 }
 
+/* Enforce config.match_limit and config.match_limit_recursion on regexp */
+static void set_limits(struct regexp *regexp) {
+    if(regexp->extra == NULL) {
+        regexp->extra = pcre_malloc(sizeof(pcre_extra));
+        if(regexp->extra == NULL) {
+            perror("malloc");
+            abort();
+        }
+        memset(regexp->extra, 0, sizeof(pcre_extra));
+    }
+    regexp->extra->flags |= PCRE_EXTRA_MATCH_LIMIT | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+    regexp->extra->match_limit = config.match_limit;
+    regexp->extra->match_limit_recursion = config.match_limit_recursion;
+}
+
+/* If p starts with *, + or {n,}, return the end of the quantifier */
+static const char *unbounded_quantifier(const char *p) {
+    if(*p == '*' || *p == '+')
+        return p + 1;
+    if(*p++ != '{' || !isdigit(*p))
+        return NULL;
+    while(isdigit(*p))
+        p++;
+    return (p[0] == ',' && p[1] == '}') ? p + 2 : NULL;
+}
+
+/* Characters an escape (p just after the \) can start with, in set */
+static void escape_chars(const char *p, unsigned char *set) {
+    int c;
+    
+    if(!isalnum((unsigned char)*p)) {
+        set[(unsigned char)*p / 8] |= 1 << ((unsigned char)*p % 8);
+        return;
+    }
+    for(c = 1; c < 256; c++) {
+        switch(*p) {
+        case 'd': if(!isdigit(c)) continue; break;
+        case 'D': if(isdigit(c)) continue; break;
+        case 'w': if(!isalnum(c) && c != '_') continue; break;
+        case 'W': if(isalnum(c) || c == '_') continue; break;
+        case 's': if(!isspace(c)) continue; break;
+        case 'S': if(isspace(c)) continue; break;
+        /* anything else, assertions included: assume any character */
+        }
+        set[c / 8] |= 1 << (c % 8);
+    }
+}
+
+/* Characters the class at p (on the [) can match, in set. Return its end. */
+static const char *class_chars(const char *p, unsigned char *set) {
+    unsigned char chars[32];
+    int negate = 0, prev = -1, c, i;
+    
+    memset(chars, 0, sizeof(chars));
+    p++;
+    if(*p == '^') {
+        negate = 1;
+        p++;
+    }
+    if(*p == ']') {
+        chars[']' / 8] |= 1 << (']' % 8);
+        prev = ']';
+        p++;
+    }
+    while(*p && *p != ']') {
+        if(*p == '-' && prev >= 0 && p[1] && p[1] != ']' && p[1] != '\\') {
+            for(c = prev; c <= (unsigned char)p[1]; c++)
+                chars[c / 8] |= 1 << (c % 8);
+            prev = -1;
+            p += 2;
+        } else if(*p == '\\' && p[1]) {
+            escape_chars(p + 1, chars);
+            prev = isalnum((unsigned char)p[1]) ? -1 : (unsigned char)p[1];
+            p += 2;
+        } else {
+            prev = (unsigned char)*p;
+            chars[prev / 8] |= 1 << (prev % 8);
+            p++;
+        }
+    }
+    for(i = 0; i < 32; i++)
+        set[i] |= negate ? ~chars[i] : chars[i];
+    return *p ? p + 1 : p;
+}
+
+/* Skip the opening parenthesis at p and the group kind, like ?: or ?<name> */
+static const char *group_body(const char *p) {
+    p++;
+    if(*p != '?')
+        return p;
+    p++;
+    if(strchr(":>=!|", *p))
+        return p + 1;
+    if(*p == '<' && (p[1] == '=' || p[1] == '!'))
+        return p + 2;
+    if(*p == '<' || *p == 'P' || *p == '\'') {
+        while(*p && *p != '>' && *p != '\'' && *p != ')')
+            p++;
+        return *p && *p != ')' ? p + 1 : p;
+    }
+    /* options, for the group or up to the end of the enclosing one */
+    while(isalpha((unsigned char)*p) || *p == '-')
+        p++;
+    return *p == ':' ? p + 1 : p;
+}
+
+/* Find groups repeated by an unbounded quantifier that themselves contain an
+ * unbounded quantifier, like (a+)* or (?:\w*\/)+, or alternatives that can
+ * start with the same character, like (a|aa)* or (\w|\d)+ : such patterns
+ * can take exponential time on long non-matching paths. Atomic groups and
+ * possessive quantifiers don't backtrack and are ignored. The first
+ * characters of alternatives are approximated: an optional or zero-width
+ * first atom is assumed to start with anything. */
+static int regexp_risky(const char *raw, int flags) {
+    int unbounded[256], atomic[256], overlap[256], branch_start[256];
+    /* first: union of the first characters of the branches of each group;
+     * group_first: first characters of the last closed group */
+    unsigned char first[256][32], atom[32], group_first[32];
+    int depth = 0, inner, ambiguous, risky = 0, first_atom, i, c;
+    const char *p = raw, *q;
+    
+    unbounded[0] = atomic[0] = overlap[0] = 0;
+    branch_start[0] = 1;
+    memset(first[0], 0, sizeof(first[0]));
+    while(*p) {
+        inner = ambiguous = 0;
+        first_atom = branch_start[depth];
+        memset(atom, 0, sizeof(atom));
+        switch(*p) {
+        case '\\':
+            if(*++p) {
+                escape_chars(p, atom);
+                p++;
+            }
+            break;
+        case '[':
+            p = class_chars(p, atom);
+            break;
+        case '(':
+            if(depth == 255)
+                return 0;
+            depth++;
+            unbounded[depth] = overlap[depth] = 0;
+            atomic[depth] = !strncmp(p, "(?>", 3);
+            branch_start[depth] = 1;
+            memset(first[depth], 0, sizeof(first[depth]));
+            /* a lookaround doesn't consume the character it looks at */
+            if(!strncmp(p, "(?=", 3) || !strncmp(p, "(?!", 3) || !strncmp(p, "(?<=", 4) || !strncmp(p, "(?<!", 4))
+                memset(first[depth], 0xff, sizeof(first[depth]));
+            p = group_body(p);
+            if(*p == ')') {
+                /* option setting, like (?i) */
+                depth--;
+                p++;
+            }
+            continue;
+        case '|':
+            branch_start[depth] = 1;
+            p++;
+            continue;
+        case ')':
+            if(depth == 0)
+                return 0;
+            inner = unbounded[depth] && !atomic[depth];
+            ambiguous = overlap[depth] && !atomic[depth];
+            memcpy(group_first, first[depth], sizeof(group_first));
+            depth--;
+            first_atom = branch_start[depth];
+            memcpy(atom, group_first, sizeof(atom));
+            p++;
+            break;
+        case '.':
+        case '^':
+        case '$':
+            memset(atom, 0xff, sizeof(atom));
+            p++;
+            break;
+        default:
+            atom[(unsigned char)*p / 8] |= 1 << ((unsigned char)*p % 8);
+            p++;
+            break;
+        }
+        
+        /* an atom that may be absent doesn't tell what the branch starts with */
+        if(*p == '?' || *p == '*' || !strncmp(p, "{0", 2))
+            memset(atom, 0xff, sizeof(atom));
+        
+        /* p is now after an atom, look for a quantifier */
+        if((q = unbounded_quantifier(p)) != NULL) {
+            p = q;
+            if(*p == '+') {
+                p++;
+            } else {
+                if(inner || ambiguous)
+                    risky = 1;
+                unbounded[depth] = 1;
+            }
+        } else if(inner) {
+            unbounded[depth] = 1;
+        }
+        
+        if(first_atom) {
+            if(flags & PCRE_CASELESS)
+                for(c = 'a'; c <= 'z'; c++)
+                    if(atom[c / 8] & (1 << (c % 8)) || atom[toupper(c) / 8] & (1 << (toupper(c) % 8))) {
+                        atom[c / 8] |= 1 << (c % 8);
+                        atom[toupper(c) / 8] |= 1 << (toupper(c) % 8);
+                    }
+            for(i = 0; i < 32; i++) {
+                if(first[depth][i] & atom[i])
+                    overlap[depth] = 1;
+                first[depth][i] |= atom[i];
+            }
+            branch_start[depth] = 0;
+        }
+    }
+    return risky;
+}
+
+/* Allocate an uncompiled regexp ; it is compiled by compile_regexps at
+ * mount, or by regexp_exec on first use with lazy_compile */
+static struct regexp *new_regexp(char *body, int flags) {
+    struct regexp *regexp;
+    
+    regexp = malloc(sizeof(struct regexp));
+    if(regexp == NULL) {
+        perror("malloc");
+        abort();
+    }
+    
+    regexp->regexp = NULL;
+    regexp->extra = NULL;
+    regexp->captures = 0;
+    regexp->flags = flags;
+    regexp->compiled = 0;
+    regexp->limit_hits = 0;
+    regexp->raw = body;
+    
+    if(regexp_risky(body, flags))
+        fprintf(stderr, "WARNING: regular expression \"%s\" repeats nested quantifiers or overlapping alternatives and may backtrack catastrophically\n", body);
+    return regexp;
+}
+
+/* Compile and study regexp, then publish it. Return an error message, or
+ * NULL on success. */
+static const char *regexp_compile(struct regexp *regexp) {
+    const char *error;
+    int offset;
+    
+    regexp->regexp = pcre_compile(regexp->raw, regexp->flags, &error, &offset, NULL);
+    if(regexp->regexp == NULL) {
+        __atomic_store_n(&regexp->compiled, 1, __ATOMIC_RELEASE);
+        return error;
+    }
+    
+    regexp->extra = pcre_study(regexp->regexp, 0, &error);
+    if(regexp->extra == NULL && error != NULL) {
+        regexp->regexp = NULL;
+        __atomic_store_n(&regexp->compiled, 1, __ATOMIC_RELEASE);
+        return error;
+    }
+    
+    pcre_fullinfo(regexp->regexp, regexp->extra, PCRE_INFO_CAPTURECOUNT, &regexp->captures);
+    set_limits(regexp);
+    __atomic_store_n(&regexp->compiled, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Compile a lazy regexp on its first use. Readers only pay an acquire load
+ * once it is published ; a regexp that fails to compile never matches. */
+static void regexp_ensure(struct regexp *regexp) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    const char *error;
+    
+    if(__atomic_load_n(&regexp->compiled, __ATOMIC_ACQUIRE))
+        return;
+    
+    pthread_mutex_lock(&lock);
+    if(!regexp->compiled) {
+        error = regexp_compile(regexp);
+        if(error)
+            fprintf(stderr, "WARNING: invalid regular expression: %s\n. Regular expression was :\n  %s\n", error, regexp->raw);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+struct compile_job {
+    struct regexp **regexps;
+    const char **errors;
+    int count, cap;
+    int next;
+};
+
+static void compile_job_add(struct compile_job *job, struct regexp *regexp) {
+    if(job->count == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 64;
+        job->regexps = realloc(job->regexps, job->cap * sizeof(struct regexp *));
+        if(job->regexps == NULL) {
+            perror("realloc");
+            abort();
+        }
+    }
+    job->regexps[job->count++] = regexp;
+}
+
+static void *compile_thread(void *arg) {
+    struct compile_job *job = arg;
+    int i;
+    
+    while((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+        job->errors[i] = regexp_compile(job->regexps[i]);
+    return NULL;
+}
+
+/* Compile the context regexps, and the rules ones unless lazy_compile is set,
+ * on compile_threads threads. Exit on invalid regexps. */
+static void compile_regexps(void) {
+    struct compile_job job;
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+    pthread_t *threads;
+    int nthreads, i;
+    
+    memset(&job, 0, sizeof(job));
+    for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
+        if(ctx->cmdline)
+            compile_job_add(&job, ctx->cmdline);
+        if(!config.lazy_compile)
+            for(rule = ctx->rules; rule != NULL; rule = rule->next)
+                if(rule->filename_regexp)
+                    compile_job_add(&job, rule->filename_regexp);
+    }
+    
+    job.errors = calloc(job.count + 1, sizeof(const char *));
+    nthreads = config.compile_threads < job.count ? config.compile_threads : job.count;
+    if(nthreads < 1)
+        nthreads = 1;
+    threads = calloc(nthreads + 1, sizeof(pthread_t));
+    if(job.errors == NULL || threads == NULL) {
+        perror("calloc");
+        abort();
+    }
+    
+    /* the calling thread compiles too */
+    for(i = 1; i < nthreads; i++) {
+        if(pthread_create(&threads[i], NULL, compile_thread, &job) != 0) {
+            nthreads = i;
+            break;
+        }
+    }
+    compile_thread(&job);
+    for(i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    
+    for(i = 0; i < job.count; i++) {
+        if(job.errors[i]) {
+            fprintf(stderr, "Invalid regular expression: %s\n. Regular expression was :\n  %s\n", job.errors[i], job.regexps[i]->raw);
+            exit(1);
+        }
+    }
+    
+    free(threads);
+    free(job.errors);
+    free(job.regexps);
+}
+
+/* pcre_exec wrapper reporting errors ; a regexp exceeding its budget is
+ * counted and treated as not matching */
+static int regexp_exec(struct regexp *regexp, const char *subject, int length,
+        int *ovector, int ovecsize) {
+    unsigned long hits;
+    int res;
+    
+    regexp_ensure(regexp);
+    if(regexp->regexp == NULL)
+        return PCRE_ERROR_NOMATCH;
+    res = pcre_exec(regexp->regexp, regexp->extra, subject, length, 0, 0, ovector, ovecsize);
+    
+    if(res == PCRE_ERROR_MATCHLIMIT || res == PCRE_ERROR_RECURSIONLIMIT) {
+        STAT_INC(regexp_limit_hits);
+        hits = __sync_add_and_fetch(&regexp->limit_hits, 1);
+        /* log the 1st, 2nd, 4th, 8th... hit only */
+        if((hits & (hits - 1)) == 0)
+            fprintf(stderr, "WARNING: regular expression \"%s\" exceeded its %s limit on \"%.*s\" (%lu times)\n",
+                regexp->raw, res == PCRE_ERROR_MATCHLIMIT ? "match" : "recursion", length, subject, hits);
+    } else if(res < 0 && res != PCRE_ERROR_NOMATCH) {
+        fprintf(stderr, "WARNING: pcre_exec returned %d\n", res);
+    }
+    return res;
+}
+
 /* Consume the regexp (until reaching end-of-flags) and put it in regexp */
 static void parse_regexp(FILE *fd, struct regexp **regexp, char sep) {
     char *regexp_body;
     int regexp_flags = 0;
-    const char *error;
-    int offset;
     int c;
     
     /* Determine separator */
@@ -178,30 +604,10 @@ static void parse_regexp(FILE *fd, struct regexp **regexp, char sep) {
         }
     }
     
-    /* Compilation */
-    *regexp = malloc(sizeof(struct regexp));
-    if(regexp == NULL) {
-        perror("malloc");
-        abort();
-    }
-    
-    (*regexp)->regexp = pcre_compile(regexp_body, regexp_flags, &error, &offset, NULL);
-    if((*regexp)->regexp == NULL) {
-        fprintf(stderr, "Invalid regular expression: %s\n. Regular expression was :\n  %s\n", error, regexp_body);
-        exit(1);
-    }
-    
-    (*regexp)->extra = pcre_study((*regexp)->regexp, 0, &error);
-    if((*regexp)->extra == NULL && error != NULL) {
-        fprintf(stderr, "Can't compile regular expression: %s\n. Regular expression was :\n  %s\n", error, regexp_body);
-        exit(1);
-    }
-    
-    pcre_fullinfo((*regexp)->regexp, (*regexp)->extra, PCRE_INFO_CAPTURECOUNT, &(*regexp)->captures);
-    (*regexp)->raw = regexp_body;
+    *regexp = new_regexp(regexp_body, regexp_flags);
 }
 
-/* Get a CMDLINE or RULE definition */
+/* Get a CMDLINE, RULE or MAP definition */
 static void parse_item(FILE *fd, enum type *type, struct regexp **regexp, char **string) {
     int c;
     
@@ -221,6 +627,11 @@ static void parse_item(FILE *fd, enum type *type, struct regexp **regexp, char *
         parse_blanks(fd);
         parse_string(fd, string, '\n');
         return;
+    case '=':
+        *type = MAP;
+        parse_blanks(fd);
+        parse_string(fd, string, '\n');
+        return;
     case '#':
         parse_comment(fd);
         parse_item(fd, type, regexp, string);
@@ -248,6 +659,7 @@ static void parse_config(FILE *fd) {
         abort();
     } else {
         current_context->cmdline = NULL;
+        current_context->index = 0;
         current_context->rules = NULL;
         current_context->next = NULL;
         config.contexts = current_context;
@@ -262,20 +674,30 @@ static void parse_config(FILE *fd) {
                 abort();
             } else {
                 new_context->cmdline = !strcmp(regexp->raw, "") ? NULL : regexp;
+                new_context->index = 0;
                 new_context->rules = last_rule = NULL;
                 new_context->next = NULL;
                 current_context->next = new_context;
                 current_context = new_context;
             }
-        } else if(type == RULE) {
+        } else if(type == RULE || type == MAP) {
             rule = malloc(sizeof(struct rewrite_rule));
             if(rule == NULL) {
                 perror("malloc");
                 abort();
             }
             
-            rule->filename_regexp = regexp;
-            rule->rewritten_path = (!strcmp(string, ".")) ? (free(string), NULL) : string;
+            if(type == MAP) {
+                rule->filename_regexp = NULL;
+                rule->map = staticmap_open(string);
+                rule->rewritten_path = NULL;
+                free(string);
+            } else {
+                rule->filename_regexp = regexp;
+                rule->map = NULL;
+                rule->rewritten_path = (!strcmp(string, ".")) ? (free(string), NULL) : string;
+            }
+            rule->hits = 0;
             rule->next = NULL;
             if(last_rule)
                 last_rule->next = rule;
@@ -286,6 +708,494 @@ static void parse_config(FILE *fd) {
     } while(type != END);
 }
 
+/*
+ * Context matching
+ */
+/* Aho-Corasick automaton over one required literal of each context regexp,
+ * lowercased. A single scan of the caller cmdline gives the contexts whose
+ * literal appears in it; the other ones can't match and aren't run. */
+struct context_set {
+    int (*next)[256]; /* complete transition table */
+    int *fail, *dict; /* dict: nearest suffix state ending literals, or 0 */
+    int **ends; /* contexts whose literal ends in each state, -1 terminated */
+    int nstates, cap;
+    int count; /* contexts with a literal */
+};
+
+/* Skip the escape at p (just after the \), return the next character */
+static const char *skip_escape(const char *p) {
+    const char *end;
+    char c;
+
+    switch(*p) {
+    case 'x':
+        p++;
+        if(*p == '{')
+            return strchr(p, '}') ? strchr(p, '}') + 1 : p + strlen(p);
+        if(isxdigit((unsigned char)*p))
+            p++;
+        if(isxdigit((unsigned char)*p))
+            p++;
+        return p;
+    case 'c':
+        return p[1] ? p + 2 : p + 1;
+    case 'p':
+    case 'P':
+        p++;
+        if(*p == '{')
+            return strchr(p, '}') ? strchr(p, '}') + 1 : p + strlen(p);
+        return *p ? p + 1 : p;
+    case 'k':
+    case 'g':
+    case 'N':
+    case 'o':
+        /* \k<name>, \g{-1}, \N{U+41}, \o{101}... */
+        c = *p++;
+        if(*p == '<' || *p == '{' || *p == '\'') {
+            end = strchr(p + 1, *p == '<' ? '>' : *p == '{' ? '}' : '\'');
+            return end ? end + 1 : p + strlen(p);
+        }
+        if(c == 'g' && (*p == '-' || *p == '+'))
+            p++;
+        while(c == 'g' && isdigit((unsigned char)*p))
+            p++;
+        return p;
+    default:
+        if(isdigit((unsigned char)*p)) {
+            while(isdigit((unsigned char)*p))
+                p++;
+            return p;
+        }
+        return *p ? p + 1 : p;
+    }
+}
+
+/* Skip the character class at p (on the [) */
+static const char *skip_class(const char *p) {
+    p++;
+    if(*p == '^')
+        p++;
+    if(*p == ']')
+        p++;
+    while(*p && *p != ']') {
+        if(*p == '\\' && p[1])
+            p++;
+        else if(*p == '[' && p[1] == ':' && strstr(p + 2, ":]"))
+            /* POSIX class, like [:alpha:] */
+            p = strstr(p + 2, ":]") + 1;
+        p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+/* The end of the {n}, {n,} or {n,m} quantifier at p, or NULL if the brace
+ * is a literal */
+static const char *quantifier_end(const char *p) {
+    p++;
+    if(!isdigit((unsigned char)*p))
+        return NULL;
+    while(isdigit((unsigned char)*p))
+        p++;
+    if(*p == ',')
+        for(p++; isdigit((unsigned char)*p); p++);
+    return *p == '}' ? p + 1 : NULL;
+}
+
+/* Put in literal the longest string every match of regexp contains,
+ * lowercased, and return its length, or 0 if none was found. Only the top
+ * level of the pattern is looked at: groups are skipped, and a top-level
+ * alternation, option settings or extended syntax give up. */
+static int required_literal(const struct regexp *regexp, char *literal, int size) {
+    const char *p = regexp->raw, *q;
+    char run[256];
+    int len = 0, best = 0, depth = 0;
+    
+    if((regexp->flags & PCRE_EXTENDED) ||
+            /* with UTF-8, a caseless "k" also matches U+212A */
+            ((regexp->flags & PCRE_CASELESS) && (regexp->flags & PCRE_UTF8)) ||
+            strstr(p, "(*") || strstr(p, "\\Q") || strstr(p, "\\E"))
+        return 0;
+    for(q = strstr(p, "(?"); q; q = strstr(q + 2, "(?"))
+        if(strchr("imsxXUJ-", q[2]))
+            return 0;
+    
+#define END_RUN() do { \
+        if(len > best && len < size) { \
+            memcpy(literal, run, len); \
+            best = len; \
+        } \
+        len = 0; \
+    } while(0)
+    
+    while(*p) {
+        if(*p == '\\') {
+            if(depth == 0 && p[1] && !isalnum((unsigned char)p[1])) {
+                if(len < (int)sizeof(run))
+                    run[len++] = tolower((unsigned char)p[1]);
+                p += 2;
+                continue;
+            }
+            if(depth == 0)
+                END_RUN();
+            p = skip_escape(p + 1);
+        } else if(*p == '[') {
+            if(depth == 0)
+                END_RUN();
+            p = skip_class(p);
+        } else if(*p == '(') {
+            if(depth++ == 0)
+                END_RUN();
+            p++;
+        } else if(*p == ')') {
+            if(depth > 0)
+                depth--;
+            p++;
+        } else if(depth > 0) {
+            p++;
+        } else if(*p == '|') {
+            return 0;
+        } else if(strchr("*?+", *p) || (*p == '{' && (q = quantifier_end(p)) != NULL)) {
+            /* the quantified character may be absent, and with UTF-8 it
+             * may be several bytes */
+            if((regexp->flags & PCRE_UTF8))
+                while(len > 0 && (run[len - 1] & 0xc0) == 0x80)
+                    len--;
+            if(len > 0)
+                len--;
+            END_RUN();
+            p = *p == '{' ? q : p + 1;
+        } else if(strchr(".^$", *p)) {
+            END_RUN();
+            p++;
+        } else {
+            if(len < (int)sizeof(run))
+                run[len++] = tolower((unsigned char)*p);
+            p++;
+        }
+    }
+    END_RUN();
+#undef END_RUN
+    /* too short to filter anything out */
+    return best >= 3 ? best : 0;
+}
+
+static int context_state(struct context_set *set) {
+    if(set->nstates == set->cap) {
+        set->cap = set->cap ? set->cap * 2 : 64;
+        set->next = realloc(set->next, set->cap * sizeof(*set->next));
+        set->fail = realloc(set->fail, set->cap * sizeof(int));
+        set->dict = realloc(set->dict, set->cap * sizeof(int));
+        set->ends = realloc(set->ends, set->cap * sizeof(int *));
+        if(set->next == NULL || set->fail == NULL || set->dict == NULL || set->ends == NULL) {
+            perror("realloc");
+            abort();
+        }
+    }
+    memset(set->next[set->nstates], 0, sizeof(*set->next));
+    set->fail[set->nstates] = set->dict[set->nstates] = 0;
+    set->ends[set->nstates] = NULL;
+    return set->nstates++;
+}
+
+static void context_add(struct context_set *set, const char *literal, int len, int index) {
+    int state = 0, i, n = 0;
+    
+    for(i = 0; i < len; i++) {
+        unsigned char c = literal[i];
+        if(set->next[state][c] == 0) {
+            int new = context_state(set);
+            set->next[state][c] = new;
+        }
+        state = set->next[state][c];
+    }
+    while(set->ends[state] && set->ends[state][n] >= 0)
+        n++;
+    set->ends[state] = realloc(set->ends[state], (n + 2) * sizeof(int));
+    if(set->ends[state] == NULL) {
+        perror("realloc");
+        abort();
+    }
+    set->ends[state][n] = index;
+    set->ends[state][n + 1] = -1;
+}
+
+/* Fill failure links breadth first, turning the trie into a DFA */
+static void context_link(struct context_set *set) {
+    int *queue = malloc(set->nstates * sizeof(int));
+    int head = 0, tail = 0, state, c, child, fail;
+    
+    if(queue == NULL) {
+        perror("malloc");
+        abort();
+    }
+    for(c = 0; c < 256; c++)
+        if(set->next[0][c])
+            queue[tail++] = set->next[0][c];
+    while(head < tail) {
+        state = queue[head++];
+        for(c = 0; c < 256; c++) {
+            child = set->next[state][c];
+            fail = set->next[set->fail[state]][c];
+            if(child == 0) {
+                set->next[state][c] = fail;
+                continue;
+            }
+            set->fail[child] = fail;
+            set->dict[child] = set->ends[fail] ? fail : set->dict[fail];
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+}
+
+/* Give each context with a required literal an index in config.cmdlines */
+static void build_cmdlines(void) {
+    struct context_set *set;
+    struct rewrite_context *ctx;
+    char literal[256];
+    int len;
+    
+    set = calloc(1, sizeof(struct context_set));
+    if(set == NULL) {
+        perror("calloc");
+        abort();
+    }
+    context_state(set);
+    for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
+        if(!ctx->cmdline || (len = required_literal(ctx->cmdline, literal, sizeof(literal))) == 0)
+            continue;
+        ctx->index = ++set->count;
+        context_add(set, literal, len, ctx->index);
+        DEBUG(2, "Context \"%s\" needs \"%.*s\"\n", ctx->cmdline->raw, len, literal);
+    }
+    if(set->count == 0) {
+        free(set->next);
+        free(set->fail);
+        free(set->dict);
+        free(set->ends);
+        free(set);
+        return;
+    }
+    context_link(set);
+    config.cmdlines = set;
+}
+
+/* Return an array telling, for each context index, whether its literal
+ * appears in caller, or NULL on error */
+static char *match_cmdlines(const char *caller) {
+    struct context_set *set = config.cmdlines;
+    char *found = calloc(set->count + 1, 1);
+    int state = 0, t, *e;
+    
+    if(found == NULL)
+        return NULL;
+    for(; *caller; caller++) {
+        state = set->next[state][tolower((unsigned char)*caller)];
+        for(t = set->ends[state] ? state : set->dict[state]; t; t = set->dict[t])
+            for(e = set->ends[t]; *e >= 0; e++)
+                found[*e] = 1;
+    }
+    return found;
+}
+
+/*
+ * Profile-guided rules reordering
+ */
+/* The regexp of a rule, or "= FILE" for a static map */
+static const char *rule_raw(const struct rewrite_rule *rule) {
+    return rule->map ? rule->map->raw : rule->filename_regexp->raw;
+}
+
+/* Identify a rule across runs by its context, regexp and rewritten path */
+static unsigned long rule_key(const struct rewrite_context *ctx, const struct rewrite_rule *rule) {
+    const char *parts[3], *p;
+    unsigned long hash = 14695981039346656037UL;
+    int i;
+    
+    parts[0] = ctx->cmdline ? ctx->cmdline->raw : "";
+    parts[1] = rule_raw(rule);
+    parts[2] = rule->rewritten_path ? rule->rewritten_path : ".";
+    for(i = 0; i < 3; i++) {
+        for(p = parts[i]; ; p++) {
+            hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
+            if(!*p)
+                break;
+        }
+    }
+    return hash;
+}
+
+/* Read the hits of the previous runs from config.profile. Return 0 if there
+ * is no profile yet. */
+static int load_profile(void) {
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+    unsigned long key, hits;
+    FILE *fd;
+    int found = 0;
+    
+    fd = fopen(config.profile, "r");
+    if(fd == NULL)
+        return 0;
+    while(fscanf(fd, "%lx %lu\n", &key, &hits) == 2) {
+        for(ctx = config.contexts; ctx != NULL; ctx = ctx->next)
+            for(rule = ctx->rules; rule != NULL; rule = rule->next)
+                if(rule_key(ctx, rule) == key) {
+                    rule->hits = hits;
+                    found = 1;
+                }
+    }
+    fclose(fd);
+    return found;
+}
+
+/* Save the hits of all rules, accumulated with the loaded ones */
+void rewrite_save_profile(void) {
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+    FILE *fd;
+    
+    if(config.profile == NULL)
+        return;
+    fd = fopen(config.profile, "w");
+    if(fd == NULL) {
+        perror("opening profile");
+        return;
+    }
+    for(ctx = config.contexts; ctx != NULL; ctx = ctx->next)
+        for(rule = ctx->rules; rule != NULL; rule = rule->next)
+            fprintf(fd, "%016lx %lu\n", rule_key(ctx, rule), rule->hits);
+    fclose(fd);
+}
+
+/* If every path matched by regexp starts with a known string, store it in
+ * prefix and return its length, else return -1. "^\.config/" gives ".config/",
+ * "^\.(?=foo)" gives "." and "^(?!\.)" gives "". */
+static int anchored_prefix(const struct regexp *regexp, char *prefix, int size) {
+    const char *p = regexp->raw;
+    int len = 0, depth = 0;
+    
+    /* inline options could change the meaning of the prefix */
+    if(regexp->flags & PCRE_EXTENDED)
+        return -1;
+    for(p = strstr(regexp->raw, "(?"); p != NULL; p = strstr(p + 2, "(?"))
+        if(strchr("imsxXUJ-", p[2]))
+            return -1;
+    
+    /* an alternative at top level isn't anchored by a leading ^ */
+    for(p = regexp->raw; *p; p++) {
+        if(*p == '\\' && p[1]) {
+            p++;
+        } else if(*p == '[') {
+            for(p += (p[1] == '^') ? 2 : 1, p += (*p == ']'); *p && *p != ']'; p++)
+                if(*p == '\\' && p[1])
+                    p++;
+            if(!*p)
+                return -1;
+        } else if(*p == '(') {
+            depth++;
+        } else if(*p == ')') {
+            depth--;
+        } else if(*p == '|' && depth == 0) {
+            return -1;
+        }
+    }
+    
+    p = regexp->raw;
+    if(*p == '^')
+        p++;
+    else if(!strncmp(p, "\\A", 2))
+        p += 2;
+    else
+        return -1;
+    
+    while(*p && len < size) {
+        if(*p == '\\' && p[1] && !isalnum(p[1]))
+            p++;
+        else if(strchr("\\.[]()|*+?{}^$", *p))
+            break;
+        /* case folding of non-ASCII characters isn't done here */
+        if((regexp->flags & PCRE_CASELESS) && (unsigned char)*p >= 0x80)
+            break;
+        prefix[len++] = *p++;
+        if(*p == '?' || *p == '*' || *p == '{') {
+            len--;
+            break;
+        }
+        if(*p == '+')
+            break;
+    }
+    return len;
+}
+
+/* Whether no path can be matched by both rules, proven by the literal
+ * prefixes of their anchored regexps */
+static int rules_disjoint(const struct rewrite_rule *a, const struct rewrite_rule *b) {
+    char pa[64], pb[64];
+    int la, lb, i, caseless;
+    
+    /* a map can match anything */
+    if(a->map || b->map)
+        return 0;
+    la = anchored_prefix(a->filename_regexp, pa, sizeof(pa));
+    lb = anchored_prefix(b->filename_regexp, pb, sizeof(pb));
+    if(la < 0 || lb < 0)
+        return 0;
+    caseless = (a->filename_regexp->flags | b->filename_regexp->flags) & PCRE_CASELESS;
+    /* in UTF-8 mode, caseless matching folds some ASCII letters with other
+     * characters, like k with the Kelvin sign: comparing bytes isn't enough */
+    if(caseless && ((a->filename_regexp->flags | b->filename_regexp->flags) & PCRE_UTF8))
+        return 0;
+    for(i = 0; i < la && i < lb; i++)
+        if(caseless ? tolower(pa[i]) != tolower(pb[i]) : pa[i] != pb[i])
+            return 1;
+    return 0;
+}
+
+/* Move the most hit rules first. Two rules are only swapped when they are
+ * adjacent and disjoint, so rules that may match the same path keep their
+ * relative order and the first matching rule is the same for every path. */
+static void reorder_rules(void) {
+    struct rewrite_context *ctx;
+    struct rewrite_rule **rules, *rule, *tmp;
+    int count, i, swapped, moved = 0;
+    
+    for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
+        count = 0;
+        for(rule = ctx->rules; rule != NULL; rule = rule->next)
+            count++;
+        if(count < 2)
+            continue;
+        rules = malloc(count * sizeof(struct rewrite_rule *));
+        if(rules == NULL) {
+            perror("malloc");
+            abort();
+        }
+        for(i = 0, rule = ctx->rules; rule != NULL; rule = rule->next)
+            rules[i++] = rule;
+        
+        do {
+            swapped = 0;
+            for(i = 0; i + 1 < count; i++) {
+                if(rules[i+1]->hits > rules[i]->hits && rules_disjoint(rules[i], rules[i+1])) {
+                    tmp = rules[i];
+                    rules[i] = rules[i+1];
+                    rules[i+1] = tmp;
+                    swapped = moved = 1;
+                }
+            }
+        } while(swapped);
+        
+        for(i = 0; i + 1 < count; i++)
+            rules[i]->next = rules[i+1];
+        rules[count-1]->next = NULL;
+        ctx->rules = rules[0];
+        free(rules);
+    }
+    if(moved)
+        DEBUG(1, "Rules reordered from profile %s\n", config.profile);
+}
+
 /*
  * Command-line arguments parsing
  */
@@ -301,6 +1211,25 @@ static struct fuse_opt options[] = {
     REWRITE_OPT("config=%s",       config_file, 0),
     REWRITE_OPT("-v %i",           verbose, 0),
     REWRITE_OPT("verbose=%i",      verbose, 0),
+    REWRITE_OPT("match_limit=%lu", match_limit, 0),
+    REWRITE_OPT("match_limit_recursion=%lu", match_limit_recursion, 0),
+    REWRITE_OPT("stats=%s",        stats_file, 0),
+    REWRITE_OPT("xattr_cache=%lu", xattr_cache, 0),
+    REWRITE_OPT("readlink_cache=%lu", readlink_cache, 0),
+    REWRITE_OPT("dir_cache=%lu",   dir_cache, 0),
+    REWRITE_OPT("dir_cache_mb=%lu", dir_cache_mb, 0),
+    REWRITE_OPT("attr_cache=%lu",  attr_cache, 0),
+    REWRITE_OPT("attr_timeout=%i", attr_timeout, 0),
+    REWRITE_OPT("warm=%i",         warm, 0),
+    REWRITE_OPT("warm_threads=%i", warm_threads, 0),
+    REWRITE_OPT("coalesce",        coalesce, 1),
+    REWRITE_OPT("xdev_rename",     xdev_rename, 1),
+    REWRITE_OPT("lazy_compile",    lazy_compile, 1),
+    REWRITE_OPT("compile_threads=%i", compile_threads, 0),
+    REWRITE_OPT("profile=%s",      profile, 0),
+    REWRITE_OPT("statfs_cache=%i", statfs_cache, 0),
+    REWRITE_OPT("trace=%s",        trace_file, 0),
+    REWRITE_OPT("account",         account, 1),
 
     FUSE_OPT_KEY("-V",             KEY_VERSION),
     FUSE_OPT_KEY("--version",      KEY_VERSION),
@@ -337,8 +1266,27 @@ static int options_proc(void *data, const char *arg, int key, struct fuse_args *
                 "    -c CONFIG        path to configuration file\n"
                 "    -r PATH          path to source filesystem\n"
                 "    -v LEVEL         verbose level [to be used with -f or -d]\n"
+                "    -o match_limit=N           pcre_exec match limit per regexp [%d]\n"
+                "    -o match_limit_recursion=N pcre_exec recursion limit per regexp [%d]\n"
+                "    -o stats=FILE      file statistics are written to on SIGUSR1 [stderr]\n"
+                "    -o xattr_cache=N   number of files with cached xattrs, 0 to disable [%d]\n"
+                "    -o readlink_cache=N number of cached symlink targets, 0 to disable [%d]\n"
+                "    -o dir_cache=N     number of cached directory listings, 0 to disable [%d]\n"
+                "    -o dir_cache_mb=N  MiB of cached listings, 0 for no limit [%d]\n"
+                "    -o attr_cache=N    number of cached attributes, 0 to disable [0]\n"
+                "    -o attr_timeout=N  seconds attributes are cached [%d]\n"
+                "    -o warm=N          entries whose attributes are fetched after opendir [0]\n"
+                "    -o warm_threads=N  threads fetching them, at idle priority [1]\n"
+                "    -o coalesce        share lookups between concurrent identical requests\n"
+                "    -o xdev_rename     move files across backing filesystems on rename\n"
+                "    -o lazy_compile    compile rules regexps on first use\n"
+                "    -o compile_threads=N threads compiling regexps at mount [number of CPUs]\n"
+                "    -o profile=FILE    rules hits file, used to move hot rules first\n"
+                "    -o statfs_cache=N  seconds statfs results are cached, 0 to disable [%d]\n"
+                "    -o trace=FILE      file requests are recorded to, for cachesim\n"
+                "    -o account         per-uid and per-cgroup costs in the statistics\n"
                 "\n",
-                outargs->argv[0]);
+                outargs->argv[0], MATCH_LIMIT, MATCH_LIMIT_RECURSION, CACHE_SIZE, CACHE_SIZE, DIR_CACHE_SIZE, DIR_CACHE_MB, ATTR_TIMEOUT, STATFS_TTL);
         fuse_opt_add_arg(outargs, "-ho");
         fuse_main(outargs->argc, outargs->argv, NULL, NULL);
         exit(0);
@@ -351,10 +1299,43 @@ static int options_proc(void *data, const char *arg, int key, struct fuse_args *
     return 1;
 }
 
+/* Make path relative to the current directory absolute */
+static char *absolute_path(char *path) {
+    char *cwd, *abs;
+    
+    if(path == NULL || path[0] == '/')
+        return path;
+    
+    cwd = get_current_dir_name();
+    if(cwd == NULL) {
+        perror("getcwd");
+        exit(1);
+    }
+    abs = malloc(strlen(cwd) + strlen(path) + 2);
+    if(abs == NULL) {
+        perror("malloc");
+        abort();
+    }
+    sprintf(abs, "%s/%s", cwd, path);
+    free(cwd);
+    return abs;
+}
+
 void parse_args(int argc, char **argv, struct fuse_args *outargs) {
     FILE *fd;
+    struct timespec start, end;
     
     memset(&config, 0, sizeof(config));
+    config.match_limit = MATCH_LIMIT;
+    config.match_limit_recursion = MATCH_LIMIT_RECURSION;
+    config.xattr_cache = CACHE_SIZE;
+    config.readlink_cache = CACHE_SIZE;
+    config.dir_cache = DIR_CACHE_SIZE;
+    config.dir_cache_mb = DIR_CACHE_MB;
+    config.attr_timeout = ATTR_TIMEOUT;
+    config.warm_threads = 1;
+    config.compile_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    config.statfs_cache = STATFS_TTL;
     fuse_opt_parse(outargs, &config, options, options_proc);
     fuse_opt_add_arg(outargs, "-o");
     fuse_opt_add_arg(outargs, "use_ino,default_permissions");
@@ -376,6 +1357,16 @@ void parse_args(int argc, char **argv, struct fuse_args *outargs) {
         fprintf(stderr, "missing mount point argument\n");
         exit(1);
     }
+
+    if(config.warm > 0 && (config.attr_cache == 0 || config.warm_threads <= 0)) {
+        fprintf(stderr, "WARNING: warm needs attr_cache and warm_threads, disabling it\n");
+        config.warm = 0;
+    }
+
+    /* the daemon chdirs to / */
+    config.stats_file = absolute_path(config.stats_file);
+    config.profile = absolute_path(config.profile);
+    config.trace_file = absolute_path(config.trace_file);
    
     if(config.config_file) {
         if(strncmp(config.config_file, config.mount_point, strlen(config.mount_point)) == 0) {
@@ -388,24 +1379,64 @@ void parse_args(int argc, char **argv, struct fuse_args *outargs) {
             perror("opening config file");
             exit(1);
         }
+        clock_gettime(CLOCK_MONOTONIC, &start);
         parse_config(fd);
         fclose(fd);
+        if(config.profile && load_profile())
+            reorder_rules();
+        compile_regexps();
+        build_cmdlines();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats.load_usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        DEBUG(1, "Configuration loaded in %lu us\n", stats.load_usec);
         
         struct rewrite_context *ctx;
         struct rewrite_rule *rule;
         for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
             DEBUG(1, "CTX \"%s\":\n", ctx->cmdline ? ctx->cmdline->raw : "default");
             for(rule = ctx->rules; rule != NULL; rule = rule->next)
-                DEBUG(1, "  \"%s\" -> \"%s\"\n", rule->filename_regexp->raw, rule->rewritten_path ? rule->rewritten_path : "(don't rewrite)");
+                DEBUG(1, "  \"%s\" -> \"%s\" (%lu hits)\n", rule_raw(rule), rule->map ? "(map)" : rule->rewritten_path ? rule->rewritten_path : "(don't rewrite)", rule->hits);
         }
         DEBUG(1, "\n");
     }
+
+    if(config.coalesce) {
+        struct rewrite_context *ctx;
+        for(ctx = config.contexts; ctx != NULL; ctx = ctx->next)
+            if(ctx->cmdline)
+                has_cmdlines = 1;
+        flight_init(&caller_flights, "caller");
+        flight_init(&rewrite_flights, "rewrite");
+    }
+}
+
+/*
+ * Statistics
+ */
+/* Rules in evaluation order, with their regexp limit hits and, when they
+ * are counted for the profile, their hits */
+void rewrite_stats(FILE *fd) {
+    struct rewrite_context *ctx;
+    struct rewrite_rule *rule;
+    
+    fprintf(fd, "rules:\n");
+    for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
+        fprintf(fd, "  CTX \"%s\": %lu limit hits\n", ctx->cmdline ? ctx->cmdline->raw : "default",
+            ctx->cmdline ? ctx->cmdline->limit_hits : 0);
+        for(rule = ctx->rules; rule != NULL; rule = rule->next) {
+            fprintf(fd, "    \"%s\" -> \"%s\": ", rule_raw(rule),
+                rule->map ? "(map)" : rule->rewritten_path ? rule->rewritten_path : ".");
+            if(config.profile)
+                fprintf(fd, "%lu hits, ", rule->hits);
+            fprintf(fd, "%lu limit hits\n", rule->filename_regexp ? rule->filename_regexp->limit_hits : 0);
+        }
+    }
 }
 
 /*
  * Rewrite stuff
  */
-char *get_caller_cmdline() {
+char *get_caller_cmdline(pid_t pid) {
     char path[PATH_MAX];
     FILE *fd;
     int size = 0, cap = 255, c;
@@ -418,7 +1449,7 @@ char *get_caller_cmdline() {
         *ret = 0;
     }
     
-    snprintf(path, PATH_MAX, "/proc/%d/cmdline", fuse_get_context()->pid);
+    snprintf(path, PATH_MAX, "/proc/%d/cmdline", pid);
     fd = fopen(path, "r");
     if(fd == NULL)
         return ret;
@@ -430,6 +1461,7 @@ char *get_caller_cmdline() {
     }
     
     fclose(fd);
+    PROBE2(caller__fetch, pid, ret);
     
     return ret;
 }
@@ -439,8 +1471,10 @@ char *apply_rule(const char *path, struct rewrite_rule *rule) {
     char *rewritten;
     
     if(rule == NULL || rule->rewritten_path == NULL) {
-        rewritten = strcat(strcpy(malloc(strlen(config.orig_fs)+strlen(path)+1), config.orig_fs),
-                      path);
+        rewritten = arena_alloc(strlen(config.orig_fs)+strlen(path)+1);
+        if(rewritten == NULL)
+            return NULL;
+        strcat(strcpy(rewritten, config.orig_fs), path);
         DEBUG(2, "  (ignored) %s -> %s\n", path, rewritten);
         DEBUG(3, "\n");
         return rewritten;
@@ -449,13 +1483,16 @@ char *apply_rule(const char *path, struct rewrite_rule *rule) {
     /* Fill ovector */
     nvec = (rule->filename_regexp->captures + 1) * 3;
     ovector = calloc(nvec, sizeof(int));
-    pcre_exec(rule->filename_regexp->regexp, rule->filename_regexp->extra, path+1,
-        strlen(path)-1, 0, 0, ovector, nvec);
+    regexp_exec(rule->filename_regexp, path+1, strlen(path)-1, ovector, nvec);
     
     /* rewritten = orig_fs + part of path before the matched part + rewritten_path + part of path after the matched path */
-    rewritten = malloc(strlen(config.orig_fs) + strlen(rule->rewritten_path) + 1 /* \0 */ + 
+    rewritten = arena_alloc(strlen(config.orig_fs) + strlen(rule->rewritten_path) + 1 /* \0 */ + 
         1 + ovector[0] + /* before */
         strlen(path) - ovector[1] /* after */);
+    if(rewritten == NULL) {
+        free(ovector);
+        return NULL;
+    }
     DEBUG(4, "  orig_fs = %s\n",  config.orig_fs);
     DEBUG(4, "  begin = %s\n", strndup(path, ovector[0] + 1));
     DEBUG(4, "  rewritten = %s\n", rule->rewritten_path);
@@ -472,10 +1509,60 @@ char *apply_rule(const char *path, struct rewrite_rule *rule) {
     return rewritten;
 }
 
-char *rewrite(const char *path) {
+/* rewritten = orig_fs + / + value found in a static map */
+static char *apply_map(const char *path, const char *value) {
+    char *rewritten;
+    
+    if(!strcmp(value, "."))
+        return apply_rule(path, NULL);
+    rewritten = arena_alloc(strlen(config.orig_fs) + strlen(value) + 2);
+    if(rewritten == NULL)
+        return NULL;
+    sprintf(rewritten, "%s/%s", config.orig_fs, value);
+    DEBUG(1, "  %s -> %s\n", path, rewritten);
+    DEBUG(3, "\n");
+    return rewritten;
+}
+
+/*
+ * Single-flight wrappers
+ */
+static void *caller_flight(void *arg, size_t *size) {
+    char *caller = get_caller_cmdline(*(pid_t *) arg);
+    *size = strlen(caller) + 1;
+    return caller;
+}
+
+static char *caller_cmdline(pid_t pid) {
+    char key[16], *caller;
+
+    if(!config.coalesce)
+        return get_caller_cmdline(pid);
+    snprintf(key, sizeof(key), "%d", pid);
+    caller = flight_do(&caller_flights, key, caller_flight, &pid);
+    if(caller == NULL) {
+        perror("malloc");
+        abort();
+    }
+    return caller;
+}
+
+/* What rewrite_rules matched, for the profile and the trace */
+struct rewrite_match {
+    struct rewrite_rule *rule; /* NULL when no rule matched */
+    char *caller; /* NULL when no context needed it */
+    unsigned long caller_usec;
+};
+
+/* The caller command line is returned in match, and freed by the caller */
+static char *rewrite_rules(const char *path, pid_t pid, struct rewrite_match *match) {
     struct rewrite_context *ctx;
-    struct rewrite_rule *rule;
-    char *caller = NULL;
+    struct rewrite_rule *rule = NULL;
+    char *caller = NULL, *rewritten;
+    const char *value = NULL;
+    char *cmdlines = NULL;
+    int cmdlines_done = 0;
+    unsigned long caller_start = 0, caller_usec = 0;
     
     int res;
     
@@ -483,13 +1570,22 @@ char *rewrite(const char *path) {
     
     for(ctx = config.contexts; ctx != NULL; ctx = ctx->next) {
         if(ctx->cmdline) {
+            if(TRACING || ACCOUNTING)
+                caller_start = trace_usec();
             if(!caller)
-                caller = get_caller_cmdline();
-            res = pcre_exec(ctx->cmdline->regexp, ctx->cmdline->extra, caller,
-                strlen(caller), 0, 0, NULL, 0);
+                caller = caller_cmdline(pid);
+            if(ctx->index && !cmdlines_done) {
+                cmdlines = match_cmdlines(caller);
+                cmdlines_done = 1;
+            }
+            if(ctx->index && cmdlines && !cmdlines[ctx->index])
+                res = PCRE_ERROR_NOMATCH;
+            else
+                res = regexp_exec(ctx->cmdline, caller, strlen(caller), NULL, 0);
+            if(TRACING || ACCOUNTING)
+                caller_usec += trace_usec() - caller_start;
+            PROBE2(context__match, ctx->cmdline->raw, res >= 0);
             if(res < 0) {
-                if(res != PCRE_ERROR_NOMATCH)
-                    fprintf(stderr, "WARNING: pcre_exec returned %d\n", res);
                 DEBUG(3, "  CTX NOMATCH \"%s\"\n", ctx->cmdline->raw);
                 continue;
             }
@@ -499,20 +1595,132 @@ char *rewrite(const char *path) {
         }
         
         for(rule = ctx->rules; rule != NULL; rule = rule->next) {
-            res = pcre_exec(rule->filename_regexp->regexp, rule->filename_regexp->extra, path + 1,
-                strlen(path) - 1, 0, 0, NULL, 0);
+            if(rule->map) {
+                value = staticmap_lookup(rule->map, path + 1, strlen(path) - 1);
+                res = value ? 0 : PCRE_ERROR_NOMATCH;
+            } else {
+                res = regexp_exec(rule->filename_regexp, path + 1, strlen(path) - 1, NULL, 0);
+            }
             if(res < 0) {
-                if(res != PCRE_ERROR_NOMATCH)
-                    fprintf(stderr, "WARNING: pcre_exec returned %d\n", res);
-                DEBUG(3, "    RULE NOMATCH \"%s\"\n", rule->filename_regexp->raw);
+                DEBUG(3, "    RULE NOMATCH \"%s\"\n", rule_raw(rule));
             } else {
-                DEBUG(3, "    RULE OK \"%s\" \"%s\"\n", rule->filename_regexp->raw, rule->rewritten_path ? rule->rewritten_path : "(don't rewrite)");
-                free(caller);
-                return apply_rule(path, rule);
+                PROBE2(rule__match, rule_raw(rule), path);
+                DEBUG(3, "    RULE OK \"%s\" \"%s\"\n", rule_raw(rule), value ? value : rule->rewritten_path ? rule->rewritten_path : "(don't rewrite)");
+                goto found;
             }
         }
     }
     
-    free(caller);
-    return apply_rule(path, NULL);
+found:
+    rewritten = value ? apply_map(path, value) : apply_rule(path, rule);
+    if(caller_usec)
+        ACCOUNT_ADD(ACCOUNT_CALLER_USEC, caller_usec);
+    match->rule = rule;
+    match->caller = caller;
+    match->caller_usec = caller_usec;
+    free(cmdlines);
+    return rewritten;
+}
+
+/* Count the matched rule in the profile and trace the rewrite, for every
+ * request including the ones which shared the rewrite of another */
+static void rewrite_done(const char *path, pid_t pid, const struct rewrite_match *match, unsigned long start) {
+    if(config.profile && match->rule)
+        __sync_fetch_and_add(&match->rule->hits, 1);
+    if(TRACING)
+        trace_rewrite(path, pid, match->caller, match->caller_usec, trace_usec() - start);
+}
+
+struct rewrite_query {
+    const char *path;
+    pid_t pid;
+};
+
+/* Result of rewrite_flight: the match, then the rewritten path and the
+ * caller command line if any */
+struct rewrite_shared {
+    struct rewrite_rule *rule;
+    unsigned long caller_usec;
+    int has_caller;
+    char strings[];
+};
+
+static void *rewrite_flight(void *arg, size_t *size) {
+    struct rewrite_query *q = arg;
+    struct rewrite_match match = { NULL, NULL, 0 };
+    struct rewrite_shared *shared = NULL;
+    char *rewritten = rewrite_rules(q->path, q->pid, &match);
+    size_t len, caller_len;
+
+    if(rewritten == NULL)
+        goto out;
+    len = strlen(rewritten) + 1;
+    caller_len = match.caller ? strlen(match.caller) + 1 : 0;
+    *size = sizeof(*shared) + len + caller_len;
+    shared = malloc(*size);
+    if(shared == NULL)
+        goto out;
+    shared->rule = match.rule;
+    shared->caller_usec = match.caller_usec;
+    shared->has_caller = match.caller != NULL;
+    memcpy(shared->strings, rewritten, len);
+    if(match.caller)
+        memcpy(shared->strings + len, match.caller, caller_len);
+out:
+    free(match.caller);
+    return shared;
+}
+
+/* Speculative lookups, like the ones of warming, aren't requests: they
+ * aren't counted in the profile nor traced */
+char *rewrite_pid(const char *path, pid_t pid, int speculative) {
+    struct rewrite_query q = { path, pid };
+    struct rewrite_match match = { NULL, NULL, 0 };
+    struct rewrite_shared *shared;
+    unsigned long start = TRACING ? trace_usec() : 0;
+    char *key, *rewritten;
+
+    if(!config.coalesce) {
+        rewritten = rewrite_rules(path, pid, &match);
+        if(rewritten && !speculative)
+            rewrite_done(path, pid, &match, start);
+        free(match.caller);
+        return rewritten;
+    }
+
+    key = arena_alloc(strlen(path) + 16);
+    if(key == NULL)
+        return NULL;
+    if(has_cmdlines)
+        sprintf(key, "%d:%s", pid, path);
+    else
+        strcpy(key, path);
+    shared = flight_do(&rewrite_flights, key, rewrite_flight, &q);
+    if(shared == NULL)
+        return NULL;
+    rewritten = arena_alloc(strlen(shared->strings) + 1);
+    if(rewritten) {
+        strcpy(rewritten, shared->strings);
+        match.rule = shared->rule;
+        match.caller = shared->has_caller ? shared->strings + strlen(rewritten) + 1 : NULL;
+        match.caller_usec = shared->caller_usec;
+        if(!speculative)
+            rewrite_done(path, pid, &match, start);
+    }
+    free(shared);
+    return rewritten;
+}
+
+char *rewrite(const char *path) {
+    unsigned long start = ACCOUNT_START();
+    char *rewritten;
+
+    PROBE1(rewrite__start, path);
+    rewritten = rewrite_pid(path, fuse_get_context()->pid, 0);
+    PROBE2(rewrite__end, path, rewritten);
+    if(ACCOUNTING) {
+        account_add(ACCOUNT_REWRITES, 1);
+        account_add(ACCOUNT_REWRITE_USEC, ACCOUNT_ELAPSED(start));
+    }
+    return rewritten;
 }
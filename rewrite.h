@@ -1,2 +1,43 @@
+#define DEBUG(lvl, x...) if(config.verbose >= lvl) fprintf(stderr, x)
+
+struct rewrite_context;
+struct regexp;
+struct context_set;
+
+struct config {
+    char *config_file;
+    char *orig_fs;
+    char *mount_point;
+    struct rewrite_context *contexts;
+    struct context_set *cmdlines; /* literals prefiltering contexts, NULL if none */
+    unsigned long match_limit;
+    unsigned long match_limit_recursion;
+    char *stats_file;
+    unsigned long xattr_cache;
+    unsigned long readlink_cache;
+    unsigned long dir_cache;
+    unsigned long dir_cache_mb;
+    unsigned long attr_cache;
+    int attr_timeout;
+    int warm, warm_threads;
+    int coalesce;
+    int xdev_rename;
+    int lazy_compile;
+    int compile_threads;
+    char *profile;
+    int statfs_cache;
+    char *trace_file;
+    int account;
+    int verbose;
+};
+
+extern struct config config;
+
 void parse_args(int argc, char **argv, struct fuse_args *outargs);
+/* The result lives in the request arena */
 char *rewrite(const char *path);
+/* For threads outside of FUSE requests, on behalf of process pid.
+ * Speculative lookups aren't counted in the profile nor traced. */
+char *rewrite_pid(const char *path, pid_t pid, int speculative);
+void rewrite_stats(FILE *fd);
+void rewrite_save_profile(void);
@@ -23,51 +23,192 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/sendfile.h>
+#include <sys/vfs.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
 #endif
 
 #include "rewrite.h"
+#include "stats.h"
+#include "cache.h"
+#include "alloc.h"
+#include "trace.h"
+#include "attr.h"
+#include "flight.h"
+#include "account.h"
+#include "probes.h"
+
+/* For the mount-to-ready time */
+static struct timespec start_time;
 
 /* Lock for process EUID/EGID/umask */
 static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
 
 #define RLOCK(expr) { \
+    unsigned long _usec; \
+    PROBE1(lock__wait, 0); \
     pthread_rwlock_rdlock(&rwlock);\
+    PROBE1(lock__acquire, 0); \
+    _usec = ACCOUNT_START(); \
     expr; \
+    _usec = ACCOUNT_ELAPSED(_usec); \
     pthread_rwlock_unlock(&rwlock); \
+    ACCOUNT_ADD(ACCOUNT_BACKING_USEC, _usec); \
 }
 
 #define WLOCK(expr) { \
+    PROBE1(lock__wait, 1); \
     pthread_rwlock_wrlock(&rwlock); \
+    PROBE1(lock__acquire, 1); \
     uid_t _euid = geteuid(); gid_t _egid = getegid(); mode_t _umask = umask(fuse_get_context()->umask); \
     seteuid(fuse_get_context()->uid); setegid(fuse_get_context()->gid); \
+    unsigned long _usec = ACCOUNT_START(); \
     expr; \
+    _usec = ACCOUNT_ELAPSED(_usec); \
     seteuid(_euid); setegid(_egid); umask(_umask); \
     pthread_rwlock_unlock(&rwlock); \
+    ACCOUNT_ADD(ACCOUNT_BACKING_USEC, _usec); \
+}
+
+static inline int same_file(const struct stat *a, const struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/* Backing lstat(2), shared between concurrent identical calls with
+ * -o coalesce. Only calls which read the same attr_cache_generation share
+ * one, so that a call made after a modification doesn't get what a call
+ * started before it read. Return 0 or -errno. */
+static struct flight_group lstat_flights;
+
+struct lstat_result {
+    int res;
+    struct stat st;
+};
+
+static void *lstat_flight(void *arg, size_t *size) {
+    struct lstat_result *r = malloc(sizeof(*r));
+
+    if (r == NULL)
+        return NULL;
+    RLOCK(r->res = lstat(arg, &r->st));
+    if (r->res == -1)
+        r->res = -errno;
+    *size = sizeof(*r);
+    return r;
+}
+
+static int backing_lstat(const char *new_path, struct stat *st,
+        unsigned long generation) {
+    struct lstat_result *r;
+    char *key;
+    int res;
+
+    if (!config.coalesce) {
+        RLOCK(res = lstat(new_path, st));
+        return res == -1 ? -errno : 0;
+    }
+    key = arena_alloc(strlen(new_path) + 18);
+    if (key == NULL)
+        return -ENOMEM;
+    sprintf(key, "%lx:%s", generation, new_path);
+    r = flight_do(&lstat_flights, key, lstat_flight, (void *) new_path);
+    if (r == NULL)
+        return -ENOMEM;
+    *st = r->st;
+    res = r->res;
+    free(r);
+    return res;
+}
+
+/* Inode caches of symlink targets and of extended attributes, see
+ * cached_readlink and rewrite_getxattr */
+static struct cache readlink_cache, xattr_cache;
+
+/* Attribute generations, needed by the attributes cache and by the
+ * coalesced lstat calls */
+#define ATTR_GENERATIONS (config.attr_cache || config.coalesce)
+
+/* Drop the cached attributes of new_path and, when its directory entry was
+ * created or removed, the ones of its parent */
+static void attr_changed(const char *new_path, int parent) {
+    char *dir, *slash;
+
+    if (!ATTR_GENERATIONS)
+        return;
+    attr_cache_invalidate(new_path);
+    slash = strrchr(new_path, '/');
+    if (!parent || slash == NULL)
+        return;
+    dir = arena_alloc(slash - new_path + 1);
+    if (dir == NULL) {
+        attr_cache_clear();
+        return;
+    }
+    memcpy(dir, new_path, slash - new_path);
+    dir[slash - new_path] = '\0';
+    attr_cache_invalidate(dir);
+}
+
+/* Open file. Closing a descriptor only matters to the backing filesystem
+ * when it releases POSIX locks or when the filesystem writes back or
+ * reports errors on close: flush is skipped otherwise. */
+struct rewrite_file {
+    int fd;
+    int locked; /* POSIX locks were taken through rewrite_lock */
+    int needs_flush; /* the backing filesystem does work on close */
+    char *new_path; /* with ATTR_GENERATIONS, to invalidate its attributes */
+    char *path; /* as opened, to trace the mutations of unlinked files and
+                 * to notice renames */
+};
+
+static struct slab file_slab;
+
+static inline struct rewrite_file *get_file(struct fuse_file_info *fi) {
+    return (struct rewrite_file *) (uintptr_t) fi->fh;
 }
 
 static int rewrite_getattr(const char *path, struct stat *stbuf) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
-    char *new_path = rewrite(path);
+    unsigned long start = 0, rewritten = 0, generation;
+    char *new_path;
+
+    if (TRACING)
+        start = trace_usec();
+    new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(res = lstat(new_path, stbuf));
-    free(new_path);
-    if (res == -1)
-        return -errno;
+    if (TRACING)
+        rewritten = trace_usec();
+    res = attr_cache_get(new_path, stbuf);
+    if (res == ATTR_MISS) {
+        generation = attr_cache_generation(new_path);
+        res = backing_lstat(new_path, stbuf, generation);
+        if (res == 0 || res == -ENOENT)
+            attr_cache_put(new_path, res == 0 ? stbuf : NULL, generation);
+    }
+    if (TRACING)
+        trace_getattr(path, -res, rewritten - start, trace_usec() - rewritten);
 
-    return 0;
+    return res;
 }
 
 static int rewrite_fgetattr(const char *path, struct stat *stbuf,
         struct fuse_file_info *fi) {
+    OP_PROBE;
     int res;
 
     (void) path;
 
-    RLOCK(res = fstat(fi->fh, stbuf));
+    RLOCK(res = fstat(get_file(fi)->fd, stbuf));
     if (res == -1)
         return -errno;
 
@@ -75,27 +216,88 @@ static int rewrite_fgetattr(const char *path, struct stat *stbuf,
 }
 
 static int rewrite_access(const char *path, int mask) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
     RLOCK(res = access(new_path, mask));
-    free(new_path);
     if (res == -1)
         return -errno;
 
     return 0;
 }
 
+/* Symlinks targets cache */
+struct readlink_query {
+    char *buf;
+    size_t size;
+};
+
+static void readlink_put(void **data, void *arg) {
+    if (*data == NULL)
+        *data = strdup(arg);
+}
+
+/* Copy the cached target into buf, truncated like readlink does */
+static int readlink_copy(void *data, void *arg) {
+    struct readlink_query *q = arg;
+    size_t len = strlen(data);
+
+    if (len > q->size)
+        len = q->size;
+    memcpy(q->buf, data, len);
+    return len;
+}
+
+/* readlink(2) through readlink_cache, keyed by the inode of the symlink and
+ * validated by its ctime. The target of a symlink never changes: replacing
+ * it, through the mount point or not, gives another inode or ctime. */
+static int cached_readlink(const char *new_path, char *buf, size_t size) {
+    struct readlink_query q = { buf, size };
+    char target[PATH_MAX];
+    struct stat st;
+    int res;
+
+    RLOCK(res = lstat(new_path, &st));
+    if (res == -1 || !S_ISLNK(st.st_mode)) {
+        RLOCK(res = readlink(new_path, buf, size));
+        return res;
+    }
+    res = cache_get(&readlink_cache, &st, readlink_copy, &q);
+    if (res != CACHE_MISS)
+        return res;
+
+    RLOCK(res = readlink(new_path, target, sizeof(target)));
+    if (res == -1)
+        return -1;
+    if (res == sizeof(target)) {
+        /* maybe truncated */
+        RLOCK(res = readlink(new_path, buf, size));
+        return res;
+    }
+    target[res] = '\0';
+    /* if the symlink was replaced since st was read, this is stored under an
+     * inode and ctime which lstat won't return any more */
+    cache_put(&readlink_cache, &st, readlink_put, target);
+    return readlink_copy(target, &q);
+}
+
 static int rewrite_readlink(const char *path, char *buf, size_t size) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(res = readlink(new_path, buf, size - 1));
-    free(new_path);
+    if (readlink_cache.max > 0) {
+        res = cached_readlink(new_path, buf, size - 1);
+    } else {
+        RLOCK(res = readlink(new_path, buf, size - 1));
+    }
     if (res == -1)
         return -errno;
 
@@ -103,35 +305,394 @@ static int rewrite_readlink(const char *path, char *buf, size_t size) {
     return 0;
 }
 
+/* Directory listings, shared by every handle opening the same directory
+ * while its ctime doesn't change. A snapshot is freed when the cache and
+ * the last handle using it drop it. Concurrent misses on the same version
+ * of a directory read it once, in dir_flights. */
+static struct cache dir_cache;
+static struct flight_group dir_flights;
+
+struct dir_snapshot {
+    int refs;
+    size_t count, cap;
+    struct {
+        ino_t ino;
+        unsigned char type;
+        size_t name; /* offset in names */
+    } *entries;
+    char *names;
+    size_t names_size, names_cap;
+};
+
+static void snapshot_release(void *data) {
+    struct dir_snapshot *snap = data;
+
+    if (__sync_sub_and_fetch(&snap->refs, 1) > 0)
+        return;
+    free(snap->entries);
+    free(snap->names);
+    free(snap);
+}
+
+static size_t snapshot_weigh(void *data) {
+    struct dir_snapshot *snap = data;
+
+    return sizeof(*snap) + snap->cap * sizeof(*snap->entries) + snap->names_cap;
+}
+
+static int snapshot_get(void *data, void *arg) {
+    struct dir_snapshot *snap = data;
+
+    __sync_fetch_and_add(&snap->refs, 1);
+    *(struct dir_snapshot **) arg = snap;
+    return 0;
+}
+
+static void snapshot_put(void **data, void *arg) {
+    struct dir_snapshot *snap = arg;
+
+    if (*data != NULL)
+        return;
+    __sync_fetch_and_add(&snap->refs, 1);
+    *data = snap;
+}
+
+static int snapshot_add(struct dir_snapshot *snap, const struct dirent *entry) {
+    size_t len = strlen(entry->d_name) + 1;
+    void *p;
+
+    if (snap->count == snap->cap) {
+        snap->cap = snap->cap ? snap->cap * 2 : 64;
+        p = realloc(snap->entries, snap->cap * sizeof(*snap->entries));
+        if (p == NULL)
+            return -1;
+        snap->entries = p;
+    }
+    if (snap->names_size + len > snap->names_cap) {
+        snap->names_cap = snap->names_cap ? snap->names_cap * 2 : 1024;
+        if (snap->names_cap < snap->names_size + len)
+            snap->names_cap = snap->names_size + len;
+        p = realloc(snap->names, snap->names_cap);
+        if (p == NULL)
+            return -1;
+        snap->names = p;
+    }
+    snap->entries[snap->count].ino = entry->d_ino;
+    snap->entries[snap->count].type = entry->d_type;
+    snap->entries[snap->count].name = snap->names_size;
+    memcpy(snap->names + snap->names_size, entry->d_name, len);
+    snap->names_size += len;
+    snap->count++;
+    return 0;
+}
+
+/* Read the whole directory dp, whose attributes are st, and cache the
+ * listing unless the directory changed meanwhile */
+static struct dir_snapshot *snapshot_read(DIR *dp, const struct stat *st) {
+    struct dir_snapshot *snap = calloc(1, sizeof(*snap));
+    struct dirent *entry;
+    struct stat after;
+    int res;
+
+    if (snap == NULL)
+        return NULL;
+    snap->refs = 1;
+    while (1) {
+        errno = 0;
+        RLOCK(entry = readdir(dp));
+        if (entry == NULL)
+            break;
+        if (snapshot_add(snap, entry) == -1) {
+            errno = ENOMEM;
+            break;
+        }
+    }
+    if (errno) {
+        snapshot_release(snap);
+        return NULL;
+    }
+
+    RLOCK(res = fstat(dirfd(dp), &after));
+    if (res == 0 && same_file(&after, st))
+        cache_put(&dir_cache, st, snapshot_put, snap);
+    return snap;
+}
+
+struct snapshot_query {
+    const char *new_path;
+    const struct stat *st;
+    struct dir_snapshot *snap;
+};
+
+/* Read new_path into q->snap. The result only tells the threads which
+ * waited for this one to look in dir_cache again. */
+static void *snapshot_flight(void *arg, size_t *size) {
+    struct snapshot_query *q = arg;
+    DIR *dp;
+
+    RLOCK(dp = opendir(q->new_path));
+    if (dp == NULL)
+        return NULL;
+    q->snap = snapshot_read(dp, q->st);
+    RLOCK(closedir(dp));
+    if (q->snap == NULL)
+        return NULL;
+    *size = 1;
+    return calloc(1, 1);
+}
+
+/* A snapshot of the directory new_path, whose attributes are st, or NULL if
+ * it must be read directly. *filled is set when this thread read it. */
+static struct dir_snapshot *snapshot_lookup(const char *new_path, const struct stat *st,
+        int *filled) {
+    struct snapshot_query q = { new_path, st, NULL };
+    struct dir_snapshot *snap = NULL;
+    char key[80];
+    void *done;
+
+    *filled = 0;
+    if (cache_get(&dir_cache, st, snapshot_get, &snap) == 0)
+        return snap;
+    /* it couldn't be cached (see cache_put), don't bother reading it
+     * upfront */
+    if (cache_recent(st))
+        return NULL;
+
+    snprintf(key, sizeof(key), "%lx:%lx:%lx.%09ld", (unsigned long) st->st_dev,
+        (unsigned long) st->st_ino, (unsigned long) st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+    done = flight_do(&dir_flights, key, snapshot_flight, &q);
+    if (q.snap) {
+        /* read by this thread */
+        free(done);
+        *filled = 1;
+        return q.snap;
+    }
+    if (done == NULL)
+        return NULL;
+    free(done);
+    if (cache_get(&dir_cache, st, snapshot_get, &snap) == 0)
+        return snap;
+    return NULL;
+}
+
+/* Attributes warming: after an opendir, the attributes of the first
+ * config.warm entries are fetched into the attribute cache by idle
+ * priority threads, since a stat of each of them usually follows. A job is
+ * cancelled when its directory handle is released. */
+#define WARM_QUEUE 64
+
+struct warm_job {
+    int refs;
+    int cancelled;
+    pid_t pid; /* rules are applied as for the process which opened it */
+    char *path, *new_path;
+    struct warm_job *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct warm_job *first, *last;
+    int count;
+} warm_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+static void warm_release(struct warm_job *job) {
+    if (__sync_sub_and_fetch(&job->refs, 1) > 0)
+        return;
+    free(job->path);
+    free(job->new_path);
+    free(job);
+}
+
+/* Queue the warming of directory path, return the job for the handle */
+static struct warm_job *warm_start(const char *path, const char *new_path) {
+    struct warm_job *job = calloc(1, sizeof(*job));
+
+    if (job == NULL)
+        return NULL;
+    job->refs = 2;
+    job->pid = fuse_get_context()->pid;
+    job->path = strdup(path);
+    job->new_path = strdup(new_path);
+    if (job->path == NULL || job->new_path == NULL) {
+        free(job->path);
+        free(job->new_path);
+        free(job);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&warm_queue.lock);
+    if (warm_queue.count == WARM_QUEUE) {
+        pthread_mutex_unlock(&warm_queue.lock);
+        STAT_INC(warm_dropped);
+        job->refs = 1;
+        warm_release(job);
+        return NULL;
+    }
+    if (warm_queue.last)
+        warm_queue.last->next = job;
+    else
+        warm_queue.first = job;
+    warm_queue.last = job;
+    warm_queue.count++;
+    pthread_cond_signal(&warm_queue.cond);
+    pthread_mutex_unlock(&warm_queue.lock);
+    return job;
+}
+
+static void warm_cancel(struct warm_job *job) {
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+    warm_release(job);
+}
+
+static void warm_dir(struct warm_job *job) {
+    DIR *dp;
+    struct dirent *entry;
+    struct stat st;
+    char *path, *new_path;
+    size_t len = strcmp(job->path, "/") ? strlen(job->path) : 0;
+    unsigned long generation;
+    int res, n = 0;
+
+    RLOCK(dp = opendir(job->new_path));
+    if (dp == NULL)
+        return;
+    while (n < config.warm) {
+        if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            STAT_INC(warm_cancelled);
+            break;
+        }
+        RLOCK(entry = readdir(dp));
+        if (entry == NULL)
+            break;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        n++;
+
+        arena_reset();
+        path = arena_alloc(len + strlen(entry->d_name) + 2);
+        if (path == NULL)
+            break;
+        memcpy(path, job->path, len);
+        path[len] = '/';
+        strcpy(path + len + 1, entry->d_name);
+        new_path = rewrite_pid(path, job->pid, 1);
+        if (new_path == NULL)
+            break;
+
+        /* the entry may have been looked up already */
+        if (attr_cache_get(new_path, &st) != ATTR_MISS)
+            continue;
+        generation = attr_cache_generation(new_path);
+        res = backing_lstat(new_path, &st, generation);
+        if (res == 0 || res == -ENOENT)
+            attr_cache_put(new_path, res == 0 ? &st : NULL, generation);
+        STAT_INC(warm_entries);
+    }
+    arena_reset();
+    RLOCK(closedir(dp));
+}
+
+static void *warm_thread(void *arg) {
+    struct warm_job *job;
+
+    (void) arg;
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    while (1) {
+        pthread_mutex_lock(&warm_queue.lock);
+        while (warm_queue.first == NULL)
+            pthread_cond_wait(&warm_queue.cond, &warm_queue.lock);
+        job = warm_queue.first;
+        warm_queue.first = job->next;
+        if (warm_queue.first == NULL)
+            warm_queue.last = NULL;
+        warm_queue.count--;
+        pthread_mutex_unlock(&warm_queue.lock);
+
+        if (!__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED))
+            warm_dir(job);
+        warm_release(job);
+    }
+    return NULL;
+}
+
+static void warm_threads_start(void) {
+    pthread_t thread;
+    int i;
+
+    for (i = 0; i < config.warm_threads; i++) {
+        if (pthread_create(&thread, NULL, warm_thread, NULL) != 0) {
+            perror("starting warming thread");
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
 struct rewrite_dirp {
     DIR *dp;
     struct dirent *entry;
     off_t offset;
+    struct dir_snapshot *snap; /* instead of dp when set */
+    struct warm_job *warm;
 };
 
+static struct slab dirp_slab;
+
 static int rewrite_opendir(const char *path, struct fuse_file_info *fi) {
-    int res;
+    OP_PROBE;
+    REQUEST_ARENA;
+    int res = -1;
     char *new_path;
-    struct rewrite_dirp *d = malloc(sizeof(struct rewrite_dirp));
-    if (d == NULL)
-        return -ENOMEM;
+    struct rewrite_dirp *d;
+    struct stat st;
+    int filled;
 
     new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
-    RLOCK(d->dp = opendir(new_path));
+    d = slab_alloc(&dirp_slab);
+    if (d == NULL)
+        return -ENOMEM;
+    d->offset = 0;
+    d->entry = NULL;
+    d->snap = NULL;
+    d->warm = NULL;
+
+    /* The kernel could keep listings itself (FOPEN_CACHE_DIR, Linux 4.20),
+     * but libfuse 2 has no fuse_file_info bit to ask for it, and its
+     * high-level API no way to invalidate them. Listings are shared in
+     * dir_cache instead, so that stable directories are at least never
+     * read again from the original filesystem. */
+    if (dir_cache.max > 0) {
+        RLOCK(res = stat(new_path, &st));
+        if (res == 0 && (d->snap = snapshot_lookup(new_path, &st, &filled)) != NULL) {
+            /* a cached listing was served before, and its entries
+             * warmed then */
+            if (filled && config.warm > 0)
+                d->warm = warm_start(path, new_path);
+            d->dp = NULL;
+            fi->fh = (unsigned long) d;
+            return 0;
+        }
+    }
 
-    free(new_path);
+    RLOCK(d->dp = opendir(new_path));
 
     if (d->dp == NULL) {
         res = -errno;
-        free(d);
+        slab_free(&dirp_slab, d);
         return res;
     }
-    d->offset = 0;
-    d->entry = NULL;
 
+    if (config.warm > 0)
+        d->warm = warm_start(path, new_path);
     fi->fh = (unsigned long) d;
     return 0;
 }
@@ -140,11 +701,31 @@ static inline struct rewrite_dirp *get_dirp(struct fuse_file_info *fi) {
     return (struct rewrite_dirp *) (uintptr_t) fi->fh;
 }
 
+/* Offsets in a snapshot are entry indexes plus one */
+static void snapshot_fill(struct dir_snapshot *snap, void *buf, fuse_fill_dir_t filler,
+        off_t offset) {
+    struct stat st;
+    size_t i;
+
+    memset(&st, 0, sizeof(st));
+    for (i = offset; i < snap->count; i++) {
+        st.st_ino = snap->entries[i].ino;
+        st.st_mode = snap->entries[i].type << 12;
+        if (filler(buf, snap->names + snap->entries[i].name, &st, i + 1))
+            break;
+    }
+}
+
 static int rewrite_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi) {
+    OP_PROBE;
     struct rewrite_dirp *d = get_dirp(fi);
 
     (void) path;
+    if (d->snap) {
+        snapshot_fill(d->snap, buf, filler, offset);
+        return 0;
+    }
     if (offset != d->offset) {
         RLOCK(seekdir(d->dp, offset));
         d->entry = NULL;
@@ -175,21 +756,30 @@ static int rewrite_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 }
 
 static int rewrite_releasedir(const char *path, struct fuse_file_info *fi) {
+    OP_PROBE;
     struct rewrite_dirp *d = get_dirp(fi);
     (void) path;
-    RLOCK(closedir(d->dp));
-    free(d);
+    if (d->warm)
+        warm_cancel(d->warm);
+    if (d->snap)
+        snapshot_release(d->snap);
+    else
+        RLOCK(closedir(d->dp));
+    slab_free(&dirp_slab, d);
     return 0;
 }
 
 static int rewrite_mknod(const char *path, mode_t mode, dev_t rdev) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("mknod", path);
     WLOCK(res = mknod(new_path, mode, rdev));
-    free(new_path);
+    attr_changed(new_path, 1);
     if (res == -1)
         return -errno;
 
@@ -197,13 +787,16 @@ static int rewrite_mknod(const char *path, mode_t mode, dev_t rdev) {
 }
 
 static int rewrite_mkdir(const char *path, mode_t mode) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("mkdir", path);
     WLOCK(res = mkdir(new_path, mode));
-    free(new_path);
+    attr_changed(new_path, 1);
     if (res == -1)
         return -errno;
 
@@ -211,79 +804,329 @@ static int rewrite_mkdir(const char *path, mode_t mode) {
 }
 
 static int rewrite_unlink(const char *path) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("unlink", path);
     RLOCK(res = unlink(new_path));
+    attr_changed(new_path, 1);
     if (res == -1)
         return -errno;
-    free(new_path);
 
     return 0;
 }
 
 static int rewrite_rmdir(const char *path) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("rmdir", path);
     RLOCK(res = rmdir(new_path));
+    attr_changed(new_path, 1);
     if (res == -1)
         return -errno;
-    free(new_path);
 
     return 0;
 }
 
 static int rewrite_symlink(const char *from, const char *to) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_to;
     if ((new_to = rewrite(to)) == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("symlink", to);
     WLOCK(res = symlink(from, new_to));
-    free(new_to);
+    attr_changed(new_to, 1);
     if (res == -1)
         return -errno;
 
     return 0;
 }
 
+/* Largest copy done in one system call, so that RLOCK isn't held for too long */
+#define COPY_CHUNK (8 << 20)
+
+/* Copy size bytes from in to out, in the kernel when possible */
+static int copy_data(int in, int out, off_t size) {
+    ssize_t res = 0;
+    int use_sendfile = 0;
+
+    while (size > 0) {
+        if (!use_sendfile) {
+            RLOCK(res = copy_file_range(in, NULL, out, NULL, size < COPY_CHUNK ? size : COPY_CHUNK, 0));
+            if (res == -1 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                use_sendfile = 1;
+                continue;
+            }
+        } else {
+            RLOCK(res = sendfile(out, in, NULL, size < COPY_CHUNK ? size : COPY_CHUNK));
+        }
+        if (res == -1)
+            return -errno;
+        if (res == 0) /* source shrank */
+            break;
+        size -= res;
+    }
+    return 0;
+}
+
+#ifdef HAVE_SETXATTR
+/* Read the attribute name of fd, or its list of attributes if name is NULL,
+ * into a malloc'd buffer sized by a first call without one. Return its size
+ * or -errno. */
+static ssize_t xattr_read(int fd, const char *name, char **buf) {
+    ssize_t size, res;
+
+    for (;;) {
+        if (name) {
+            RLOCK(size = fgetxattr(fd, name, NULL, 0));
+        } else {
+            RLOCK(size = flistxattr(fd, NULL, 0));
+        }
+        if (size == -1)
+            return -errno;
+        *buf = malloc(size ? size : 1);
+        if (*buf == NULL)
+            return -ENOMEM;
+        if (name) {
+            RLOCK(res = fgetxattr(fd, name, *buf, size));
+        } else {
+            RLOCK(res = flistxattr(fd, *buf, size));
+        }
+        if (res >= 0)
+            return res;
+        res = -errno;
+        free(*buf);
+        /* on ERANGE, it grew meanwhile */
+        if (res != -ERANGE)
+            return res;
+    }
+}
+
+/* Copy the extended attributes of in to out. Those the destination doesn't
+ * support or doesn't let the caller set are skipped, like cp -a does, but
+ * failing to read one fails the move. Return 0 or -errno. */
+static int copy_xattrs(int in, int out) {
+    char *list, *value, *name;
+    ssize_t len, size;
+    int res = 0;
+
+    len = xattr_read(in, NULL, &list);
+    if (len == -ENOTSUP)
+        return 0;
+    if (len < 0)
+        return len;
+    for (name = list; name < list + len; name += strlen(name) + 1) {
+        size = xattr_read(in, name, &value);
+        if (size == -ENODATA) /* removed meanwhile */
+            continue;
+        if (size < 0) {
+            res = size;
+            break;
+        }
+        RLOCK(res = fsetxattr(out, name, value, size, 0));
+        free(value);
+        if (res == -1 && errno != ENOTSUP && errno != EPERM) {
+            res = -errno;
+            break;
+        }
+        res = 0;
+    }
+    free(list);
+    return res;
+}
+#endif
+
+/* fsync(2) the directory dir, so that entries renamed into it are on disk */
+static int sync_dir(const char *dir) {
+    int fd, res;
+
+    RLOCK(fd = open(dir, O_RDONLY | O_DIRECTORY));
+    if (fd == -1)
+        return -errno;
+    RLOCK(res = fsync(fd));
+    if (res == -1)
+        res = -errno;
+    RLOCK(close(fd));
+    return res;
+}
+
+/* Move new_from to new_to when they are on different filesystems: copy it to
+ * a temporary file next to new_to, with the same metadata, atomically rename
+ * it over new_to and remove new_from. Directories are left to the caller. */
+static int xdev_rename(const char *new_from, const char *new_to) {
+    struct stat st;
+    struct timespec times[2];
+    char *tmp, *dir, *parent, target[PATH_MAX];
+    int in = -1, out = -1, res;
+
+    RLOCK(res = lstat(new_from, &st));
+    if (res == -1)
+        return -errno;
+    if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
+        return -EXDEV;
+
+    dir = strdup(new_to);
+    if (dir == NULL)
+        return -ENOMEM;
+    tmp = malloc(strlen(new_to) + sizeof("/.rewritefs-XXXXXX"));
+    if (tmp == NULL) {
+        free(dir);
+        return -ENOMEM;
+    }
+    parent = dirname(dir);
+    sprintf(tmp, "%s/.rewritefs-XXXXXX", parent);
+
+    /* the temporary file is created as the caller, like new_to would be */
+    WLOCK(out = mkstemp(tmp));
+    if (out == -1) {
+        res = -errno;
+        free(tmp);
+        free(dir);
+        return res;
+    }
+
+    if (S_ISLNK(st.st_mode)) {
+        close(out);
+        out = -1;
+        RLOCK(res = readlink(new_from, target, sizeof(target) - 1));
+        if (res == -1)
+            goto error;
+        target[res] = '\0';
+        RLOCK(res = unlink(tmp));
+        if (res == 0) {
+            WLOCK(res = symlink(target, tmp));
+        }
+        if (res == -1)
+            goto error;
+        RLOCK(lchown(tmp, st.st_uid, st.st_gid));
+    } else {
+        RLOCK(in = open(new_from, O_RDONLY));
+        if (in == -1)
+            goto error;
+        res = copy_data(in, out, st.st_size);
+        if (res < 0) {
+            errno = -res;
+            goto error;
+        }
+        /* ownership may legitimately be impossible to keep */
+        RLOCK(fchown(out, st.st_uid, st.st_gid));
+        RLOCK(res = fchmod(out, st.st_mode & 07777));
+        if (res == -1)
+            goto error;
+#ifdef HAVE_SETXATTR
+        res = copy_xattrs(in, out);
+        if (res < 0) {
+            errno = -res;
+            goto error;
+        }
+#endif
+    }
+
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    RLOCK(utimensat(AT_FDCWD, tmp, times, AT_SYMLINK_NOFOLLOW));
+
+    /* the copy must be on disk before it replaces new_to */
+    if (out != -1) {
+        RLOCK(res = fsync(out));
+        if (res == -1)
+            goto error;
+    }
+    RLOCK(res = rename(tmp, new_to));
+    if (res == -1)
+        goto error;
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    free(tmp);
+
+    /* and so must its new name before new_from goes: on failure, keep both */
+    res = sync_dir(parent);
+    free(dir);
+    if (res < 0)
+        return res;
+    RLOCK(res = unlink(new_from));
+    if (res == -1)
+        return -errno;
+    STAT_INC(xdev_renames);
+    return 0;
+
+error:
+    res = -errno;
+    RLOCK(unlink(tmp));
+    if (in != -1)
+        close(in);
+    if (out != -1)
+        close(out);
+    free(tmp);
+    free(dir);
+    return res;
+}
+
+/* A renamed directory moves every cached path below it */
+static void attr_renamed(const char *new_from, const char *new_to) {
+    struct stat st;
+    int res;
+
+    attr_changed(new_from, 1);
+    attr_changed(new_to, 1);
+    if (!ATTR_GENERATIONS)
+        return;
+    RLOCK(res = lstat(new_to, &st));
+    if (res == -1 || S_ISDIR(st.st_mode))
+        attr_cache_clear();
+}
+
 static int rewrite_rename(const char *from, const char *to) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_from, *new_to;
     if ((new_from = rewrite(from)) == NULL)
         return -ENOMEM;
-    if ((new_to = rewrite(to)) == NULL) {
-        free(new_from);
+    if ((new_to = rewrite(to)) == NULL)
         return -ENOMEM;
-    }
 
+    TRACE_MUTATION("rename", from);
+    TRACE_MUTATION("rename", to);
     RLOCK(res = rename(new_from, new_to));
-    free(new_from);
-    free(new_to);
-    if (res == -1)
-        return -errno;
+    if (res == -1 && errno == EXDEV && config.xdev_rename)
+        res = xdev_rename(new_from, new_to);
+    else if (res == -1)
+        res = -errno;
+    attr_renamed(new_from, new_to);
 
-    return 0;
+    return res;
 }
 
 static int rewrite_link(const char *from, const char *to) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_from, *new_to;
     if ((new_from = rewrite(from)) == NULL)
         return -ENOMEM;
-    if ((new_to = rewrite(to)) == NULL) {
-        free(new_from);
+    if ((new_to = rewrite(to)) == NULL)
         return -ENOMEM;
-    }
 
+    TRACE_MUTATION("link", from);
+    TRACE_MUTATION("link", to);
     RLOCK(res = link(new_from, new_to));
-    free(new_from);
-    free(new_to);
+    attr_changed(new_from, 0);
+    attr_changed(new_to, 1);
     if (res == -1)
         return -errno;
 
@@ -291,13 +1134,16 @@ static int rewrite_link(const char *from, const char *to) {
 }
 
 static int rewrite_chmod(const char *path, mode_t mode) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("chmod", path);
     RLOCK(res = chmod(new_path, mode));
-    free(new_path);
+    attr_changed(new_path, 0);
     if (res == -1)
         return -errno;
 
@@ -305,13 +1151,16 @@ static int rewrite_chmod(const char *path, mode_t mode) {
 }
 
 static int rewrite_chown(const char *path, uid_t uid, gid_t gid) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("chown", path);
     RLOCK(res = lchown(new_path, uid, gid));
-    free(new_path);
+    attr_changed(new_path, 0);
     if (res == -1)
         return -errno;
 
@@ -319,26 +1168,51 @@ static int rewrite_chown(const char *path, uid_t uid, gid_t gid) {
 }
 
 static int rewrite_truncate(const char *path, off_t size) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("truncate", path);
     RLOCK(res = truncate(new_path, size));
-    free(new_path);
+    attr_changed(new_path, 0);
     if (res == -1)
         return -errno;
 
     return 0;
 }
 
+/* Drop the cached attributes of the file written through f. It may have been
+ * renamed since it was opened: then its current path is rewritten, and the
+ * attributes cached under that name are dropped too. */
+static void file_changed(struct rewrite_file *f, const char *path) {
+    REQUEST_ARENA;
+    char *new_path;
+
+    if (f->new_path == NULL)
+        return;
+    attr_cache_invalidate(f->new_path);
+    if (path == NULL || !strcmp(path, f->path))
+        return;
+    new_path = rewrite(path);
+    if (new_path == NULL)
+        attr_cache_clear();
+    else if (strcmp(new_path, f->new_path))
+        attr_cache_invalidate(new_path);
+}
+
 static int rewrite_ftruncate(const char *path, off_t size,
         struct fuse_file_info *fi) {
+    OP_PROBE;
     int res;
+    struct rewrite_file *f = get_file(fi);
 
-    (void) path;
+    TRACE_MUTATION("ftruncate", path ? path : f->path);
 
-    RLOCK(res = ftruncate(fi->fh, size));
+    RLOCK(res = ftruncate(f->fd, size));
+    file_changed(f, path);
     if (res == -1)
         return -errno;
 
@@ -346,41 +1220,156 @@ static int rewrite_ftruncate(const char *path, off_t size,
 }
 
 static int rewrite_utimens(const char *path, const struct timespec ts[2]) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     struct timeval tv[2];
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("utimens", path);
     tv[0].tv_sec = ts[0].tv_sec;
     tv[0].tv_usec = ts[0].tv_nsec / 1000;
     tv[1].tv_sec = ts[1].tv_sec;
     tv[1].tv_usec = ts[1].tv_nsec / 1000;
 
     RLOCK(res = utimes(new_path, tv));
-    free(new_path);
+    attr_changed(new_path, 0);
     if (res == -1)
         return -errno;
 
     return 0;
 }
 
+/* Filesystems with close-to-open consistency or their own flush, and
+ * stacked ones */
+static const unsigned int flush_magics[] = {
+    0x6969,     /* NFS */
+    0x517b,     /* SMB */
+    0xff534d42, /* CIFS */
+    0xfe534d42, /* SMB2 */
+    0x65735546, /* FUSE */
+    0x01021997, /* 9P */
+    0x00c36400, /* Ceph */
+    0x5346414f, /* AFS */
+    0x73757245, /* Coda */
+    /* stacked filesystems pass close on to the one below, which may be any
+     * of the above */
+    0x794c7630, /* overlayfs */
+    0xf15f,     /* eCryptfs */
+};
+
+/* needs_flush verdicts by backing device, so that the filesystem type, which
+ * may take a round trip to a server, isn't asked at each open. It can't
+ * change while a filesystem is mounted, but device numbers of unmounted
+ * ones are reused: verdicts are kept for FLUSH_CACHE_TIMEOUT seconds. */
+#define FLUSH_CACHE_SIZE 16
+#define FLUSH_CACHE_TIMEOUT 60
+
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        dev_t dev;
+        int needs_flush;
+        time_t expires;
+    } entries[FLUSH_CACHE_SIZE];
+    int count;
+} flush_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+static int needs_flush(int fd) {
+    struct stat st;
+    struct statfs sfs;
+    time_t now = time(NULL);
+    size_t j;
+    int res, i, verdict = 0;
+
+    RLOCK(res = fstat(fd, &st));
+    if (res == -1)
+        return 1;
+
+    pthread_mutex_lock(&flush_cache.lock);
+    for (i = 0; i < flush_cache.count; i++) {
+        if (flush_cache.entries[i].dev == st.st_dev && flush_cache.entries[i].expires > now) {
+            verdict = flush_cache.entries[i].needs_flush;
+            pthread_mutex_unlock(&flush_cache.lock);
+            return verdict;
+        }
+    }
+    pthread_mutex_unlock(&flush_cache.lock);
+
+    RLOCK(res = fstatfs(fd, &sfs));
+    if (res == -1)
+        return 1;
+    for (j = 0; j < sizeof(flush_magics) / sizeof(flush_magics[0]); j++)
+        if ((unsigned int) sfs.f_type == flush_magics[j])
+            verdict = 1;
+
+    pthread_mutex_lock(&flush_cache.lock);
+    for (i = 0; i < flush_cache.count; i++)
+        if (flush_cache.entries[i].dev == st.st_dev)
+            break;
+    if (i == FLUSH_CACHE_SIZE)
+        i = st.st_dev % FLUSH_CACHE_SIZE;
+    else if (i == flush_cache.count)
+        flush_cache.count++;
+    flush_cache.entries[i].dev = st.st_dev;
+    flush_cache.entries[i].needs_flush = verdict;
+    flush_cache.entries[i].expires = now + FLUSH_CACHE_TIMEOUT;
+    pthread_mutex_unlock(&flush_cache.lock);
+    return verdict;
+}
+
+/* Wrap the backing descriptor fd of new_path, opened as path, in a handle
+ * for fi, or close it */
+static int set_file(struct fuse_file_info *fi, int fd, const char *path, const char *new_path) {
+    struct rewrite_file *f = slab_alloc(&file_slab);
+    char *copy = NULL, *path_copy = NULL;
+
+    /* writes through the handle change the attributes of new_path. Once
+     * the file is unlinked, FUSE gives them no path. */
+    if (f != NULL && (fi->flags & O_ACCMODE) != O_RDONLY &&
+            ((ATTR_GENERATIONS && (copy = strdup(new_path)) == NULL) ||
+             ((ATTR_GENERATIONS || TRACING) && (path_copy = strdup(path)) == NULL))) {
+        free(copy);
+        slab_free(&file_slab, f);
+        f = NULL;
+    }
+    if (f == NULL) {
+        RLOCK(close(fd));
+        return -ENOMEM;
+    }
+    f->fd = fd;
+    f->new_path = copy;
+    f->path = path_copy;
+    f->locked = 0;
+    f->needs_flush = needs_flush(fd);
+    fi->fh = (unsigned long) f;
+    return 0;
+}
+
 static int rewrite_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int fd;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("create", path);
     WLOCK(fd = open(new_path, fi->flags | O_CREAT, mode));
-    free(new_path);
+    attr_changed(new_path, 1);
     if (fd == -1)
         return -errno;
 
-    fi->fh = fd;
-    return 0;
+    /* keep O_DIRECT I/O out of the page cache of the mount too */
+    fi->direct_io = !!(fi->flags & O_DIRECT);
+    return set_file(fi, fd, path, new_path);
 }
 
 static int rewrite_open(const char *path, struct fuse_file_info *fi) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int fd;
     char *new_path = rewrite(path);
     if (new_path == NULL)
@@ -391,46 +1380,264 @@ static int rewrite_open(const char *path, struct fuse_file_info *fi) {
     } else {
         RLOCK(fd = open(new_path, fi->flags));
     }
-    free(new_path);
     if (fd == -1)
         return -errno;
+    if (fi->flags & (O_CREAT | O_TRUNC))
+        attr_changed(new_path, !!(fi->flags & O_CREAT));
 
-    fi->fh = fd;
-    return 0;
+    fi->direct_io = !!(fi->flags & O_DIRECT);
+    return set_file(fi, fd, path, new_path);
+}
+
+/* O_DIRECT requires buffers aligned on the logical block size of the backing
+ * device, which the buffers given by FUSE aren't guaranteed to be */
+#define DIRECT_IO_ALIGN 4096
+
+static inline int misaligned(const void *buf, struct fuse_file_info *fi) {
+    return (fi->flags & O_DIRECT) && ((uintptr_t) buf & (DIRECT_IO_ALIGN - 1));
+}
+
+/* Aligned buffers misaligned I/O is bounced through, one per thread and
+ * kept between requests: allocating one per request costs an mmap and page
+ * faults at the usual 128 KiB request size */
+struct bounce {
+    void *buf;
+    size_t size;
+};
+
+static pthread_key_t bounce_key;
+static pthread_once_t bounce_once = PTHREAD_ONCE_INIT;
+
+static void bounce_destroy(void *data) {
+    struct bounce *b = data;
+
+    free(b->buf);
+    free(b);
+}
+
+static void bounce_key_init(void) {
+    pthread_key_create(&bounce_key, bounce_destroy);
+}
+
+/* The bounce buffer of the current thread, of at least size bytes, or
+ * NULL */
+static void *bounce_buffer(size_t size) {
+    struct bounce *b;
+
+    pthread_once(&bounce_once, bounce_key_init);
+    b = pthread_getspecific(bounce_key);
+    if (b == NULL) {
+        b = calloc(1, sizeof(struct bounce));
+        if (b == NULL)
+            return NULL;
+        pthread_setspecific(bounce_key, b);
+    }
+    if (b->size < size) {
+        free(b->buf);
+        b->size = 0;
+        if (posix_memalign(&b->buf, DIRECT_IO_ALIGN, size)) {
+            b->buf = NULL;
+            return NULL;
+        }
+        b->size = size;
+    }
+    return b->buf;
 }
 
 static int rewrite_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi) {
+    OP_PROBE;
     int res;
+    void *bounce;
 
     (void) path;
-    RLOCK(res = pread(fi->fh, buf, size, offset));
+    if (misaligned(buf, fi)) {
+        if ((bounce = bounce_buffer(size ? size : 1)) == NULL)
+            return -ENOMEM;
+        STAT_INC(direct_io_bounces);
+        RLOCK(res = pread(get_file(fi)->fd, bounce, size, offset));
+        if (res > 0) {
+            memcpy(buf, bounce, res);
+            ACCOUNT_ADD(ACCOUNT_BYTES_READ, res);
+        }
+        else if (res == -1)
+            res = -errno;
+        return res;
+    }
+
+    RLOCK(res = pread(get_file(fi)->fd, buf, size, offset));
     if (res == -1)
         res = -errno;
+    else
+        ACCOUNT_ADD(ACCOUNT_BYTES_READ, res);
 
     return res;
 }
 
 static int rewrite_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi) {
+    OP_PROBE;
     int res;
+    void *bounce;
+    struct rewrite_file *f = get_file(fi);
+
+    TRACE_MUTATION("write", path ? path : f->path);
+    if (misaligned(buf, fi)) {
+        if ((bounce = bounce_buffer(size ? size : 1)) == NULL)
+            return -ENOMEM;
+        STAT_INC(direct_io_bounces);
+        memcpy(bounce, buf, size);
+        buf = bounce;
+    }
 
-    (void) path;
-    RLOCK(res = pwrite(fi->fh, buf, size, offset));
+    RLOCK(res = pwrite(f->fd, buf, size, offset));
+    /* after the write, so that a concurrent lookup can't cache the old
+     * attributes */
+    file_changed(f, path);
     if (res == -1)
         res = -errno;
+    else
+        ACCOUNT_ADD(ACCOUNT_BYTES_WRITTEN, res);
 
     return res;
 }
 
-static int rewrite_statfs(const char *path, struct statvfs *stbuf) {
+/* statfs cache: every path of a backing filesystem gives the same answer,
+ * which is kept for config.statfs_cache seconds */
+#define STATFS_CACHE_SIZE 16
+
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        dev_t dev;
+        struct statvfs st;
+        time_t expires;
+    } entries[STATFS_CACHE_SIZE];
+    int count;
+    int single_fs; /* nothing is mounted below orig_fs */
+    time_t single_fs_expires;
+    int orig_dev_known;
+    dev_t orig_dev; /* of orig_fs, which can't change while mounted */
+} statfs_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+/* Whether no filesystem is mounted below orig_fs, according to
+ * /proc/self/mountinfo. Must be called with statfs_cache.lock held. */
+static int single_fs(time_t now) {
+    char line[PATH_MAX * 2], mount_point[PATH_MAX];
+    size_t len = strlen(config.orig_fs);
+    struct stat st;
+    FILE *fd;
     int res;
+
+    if (now < statfs_cache.single_fs_expires)
+        return statfs_cache.single_fs;
+    statfs_cache.single_fs_expires = now + config.statfs_cache;
+    statfs_cache.single_fs = 0;
+
+    if (!statfs_cache.orig_dev_known) {
+        RLOCK(res = stat(config.orig_fs, &st));
+        if (res == -1)
+            return 0;
+        statfs_cache.orig_dev = st.st_dev;
+        statfs_cache.orig_dev_known = 1;
+    }
+
+    /* mountinfo escapes these characters */
+    if (strpbrk(config.orig_fs, " \t\n\\"))
+        return 0;
+    fd = fopen("/proc/self/mountinfo", "r");
+    if (fd == NULL)
+        return 0;
+    statfs_cache.single_fs = 1;
+    while (fgets(line, sizeof(line), fd)) {
+        if (sscanf(line, "%*s %*s %*s %*s %4095s", mount_point) == 1 &&
+                !strncmp(mount_point, config.orig_fs, len) && mount_point[len] == '/') {
+            statfs_cache.single_fs = 0;
+            break;
+        }
+    }
+    fclose(fd);
+    return statfs_cache.single_fs;
+}
+
+/* statvfs(2) through statfs_cache. new_path is NULL if it is known to be on
+ * the same filesystem as orig_fs. */
+static int cached_statvfs(const char *new_path, struct statvfs *stbuf) {
+    struct stat st;
+    time_t now = time(NULL);
+    dev_t dev;
+    int res, i;
+
+    /* statvfs follows symlinks: the filesystem is the one of their target */
+    if (new_path == NULL) {
+        dev = statfs_cache.orig_dev;
+    } else if (attr_cache_get(new_path, &st) == 0 && !S_ISLNK(st.st_mode)) {
+        dev = st.st_dev;
+    } else {
+        RLOCK(res = stat(new_path, &st));
+        if (res == -1)
+            return -errno;
+        dev = st.st_dev;
+    }
+
+    pthread_mutex_lock(&statfs_cache.lock);
+    for (i = 0; i < statfs_cache.count; i++) {
+        if (statfs_cache.entries[i].dev == dev && statfs_cache.entries[i].expires > now) {
+            *stbuf = statfs_cache.entries[i].st;
+            pthread_mutex_unlock(&statfs_cache.lock);
+            STAT_INC(statfs_hits);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&statfs_cache.lock);
+
+    STAT_INC(statfs_misses);
+    RLOCK(res = statvfs(new_path ? new_path : config.orig_fs, stbuf));
+    if (res == -1)
+        return -errno;
+
+    pthread_mutex_lock(&statfs_cache.lock);
+    for (i = 0; i < statfs_cache.count; i++)
+        if (statfs_cache.entries[i].dev == dev)
+            break;
+    if (i == STATFS_CACHE_SIZE)
+        i = dev % STATFS_CACHE_SIZE;
+    else if (i == statfs_cache.count)
+        statfs_cache.count++;
+    statfs_cache.entries[i].dev = dev;
+    statfs_cache.entries[i].st = *stbuf;
+    statfs_cache.entries[i].expires = now + config.statfs_cache;
+    pthread_mutex_unlock(&statfs_cache.lock);
+    return 0;
+}
+
+static int rewrite_statfs(const char *path, struct statvfs *stbuf) {
+    OP_PROBE;
+    REQUEST_ARENA;
+    int res, single;
+    size_t len = strlen(config.orig_fs);
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    if (config.statfs_cache > 0) {
+        /* orig_fs itself, canonical, crosses no symlink: with nothing
+         * mounted below it, it is on the filesystem of orig_fs. Other paths
+         * may lead anywhere through symlinks. */
+        if (!strncmp(new_path, config.orig_fs, len) &&
+                (new_path[len] == '\0' || !strcmp(new_path + len, "/"))) {
+            pthread_mutex_lock(&statfs_cache.lock);
+            single = single_fs(time(NULL));
+            pthread_mutex_unlock(&statfs_cache.lock);
+            if (single) {
+                STAT_INC(statfs_stats_skipped);
+                return cached_statvfs(NULL, stbuf);
+            }
+        }
+        return cached_statvfs(new_path, stbuf);
+    }
+
     RLOCK(res = statvfs(new_path, stbuf));
-    free(new_path);
     if (res == -1)
         return -errno;
 
@@ -438,10 +1645,16 @@ static int rewrite_statfs(const char *path, struct statvfs *stbuf) {
 }
 
 static int rewrite_flush(const char *path, struct fuse_file_info *fi) {
+    OP_PROBE;
     int res;
+    struct rewrite_file *f = get_file(fi);
 
     (void) path;
-    RLOCK(res = close(dup(fi->fh)));
+    if (!f->locked && !f->needs_flush) {
+        STAT_INC(flushes_skipped);
+        return 0;
+    }
+    RLOCK(res = close(dup(f->fd)));
     if (res == -1)
         return -errno;
 
@@ -449,14 +1662,21 @@ static int rewrite_flush(const char *path, struct fuse_file_info *fi) {
 }
 
 static int rewrite_release(const char *path, struct fuse_file_info *fi) {
+    OP_PROBE;
+    struct rewrite_file *f = get_file(fi);
+
     (void) path;
-    RLOCK(close(fi->fh));
+    RLOCK(close(f->fd));
+    free(f->new_path);
+    free(f->path);
+    slab_free(&file_slab, f);
 
     return 0;
 }
 
 static int rewrite_fsync(const char *path, int isdatasync,
         struct fuse_file_info *fi) {
+    OP_PROBE;
     int res;
     (void) path;
 
@@ -464,11 +1684,11 @@ static int rewrite_fsync(const char *path, int isdatasync,
     (void) isdatasync;
 #else
     if (isdatasync) {
-        RLOCK(res = fdatasync(fi->fh));
+        RLOCK(res = fdatasync(get_file(fi)->fd));
     } else
 #endif
     {
-        RLOCK(res = fsync(fi->fh));
+        RLOCK(res = fsync(get_file(fi)->fd));
     }
     if (res == -1)
         return -errno;
@@ -477,15 +1697,132 @@ static int rewrite_fsync(const char *path, int isdatasync,
 }
 
 #ifdef HAVE_SETXATTR
+/* Extended attributes cache: the values (or the lack of them) of every
+ * attribute fetched on a backing inode, so that the security.selinux and
+ * system.posix_acl_access probes of ls -l cost an lstat only. Changing an
+ * attribute, even outside of the mount point with setfattr, setfacl or
+ * chcon, changes the ctime of the inode, which drops the entry. */
+struct xattr_value {
+    char *name;
+    char *value; /* NULL if the attribute doesn't exist */
+    int size; /* -errno if the attribute doesn't exist */
+    struct xattr_value *next;
+};
+
+struct xattr_query {
+    const char *name;
+    char *value;
+    size_t size;
+};
+
+static void xattr_destroy(void *data) {
+    struct xattr_value *v = data, *next;
+    for(; v != NULL; v = next) {
+        next = v->next;
+        free(v->name);
+        free(v->value);
+        free(v);
+    }
+}
+
+/* Answer a getxattr query from the cached values of an inode */
+static int xattr_answer(const struct xattr_value *v, struct xattr_query *q) {
+    if(v->value == NULL)
+        return v->size;
+    if(q->size == 0)
+        return v->size;
+    if(q->size < (size_t) v->size)
+        return -ERANGE;
+    memcpy(q->value, v->value, v->size);
+    return v->size;
+}
+
+static int xattr_get(void *data, void *arg) {
+    struct xattr_value *v;
+    struct xattr_query *q = arg;
+
+    for(v = data; v != NULL; v = v->next)
+        if(!strcmp(v->name, q->name))
+            return xattr_answer(v, q);
+    return CACHE_MISS;
+}
+
+static void xattr_put(void **data, void *arg) {
+    struct xattr_value *v = arg, *copy;
+
+    copy = malloc(sizeof(struct xattr_value));
+    if(copy == NULL)
+        return;
+    copy->name = strdup(v->name);
+    copy->value = v->value ? malloc(v->size ? v->size : 1) : NULL;
+    if(copy->name == NULL || (v->value && copy->value == NULL)) {
+        free(copy->name);
+        free(copy->value);
+        free(copy);
+        return;
+    }
+    if(v->value)
+        memcpy(copy->value, v->value, v->size);
+    copy->size = v->size;
+    copy->next = *data;
+    *data = copy;
+}
+
+/* Most attributes, like SELinux labels and ACLs, fit in one read of this
+ * size */
+#define XATTR_SMALL 256
+
+/* Fetch the whole attribute of new_path, whose attributes were st, into
+ * the cache and answer q from it. Return CACHE_MISS if it can't be cached.
+ * If the attribute changed since st was read, the entry is stored under
+ * the old ctime and never found again. */
+static int xattr_fetch(const char *new_path, const struct stat *st, struct xattr_query *q) {
+    struct xattr_value v;
+    char small[XATTR_SMALL];
+    int res;
+
+    v.name = (char *) q->name;
+    v.value = NULL;
+    RLOCK(v.size = lgetxattr(new_path, q->name, small, sizeof(small)));
+    if(v.size == -1 && errno == ERANGE) {
+        RLOCK(v.size = lgetxattr(new_path, q->name, NULL, 0));
+        if(v.size == -1)
+            return CACHE_MISS;
+        v.value = malloc(v.size ? v.size : 1);
+        if(v.value == NULL)
+            return CACHE_MISS;
+        RLOCK(res = lgetxattr(new_path, q->name, v.value, v.size));
+        if(res != v.size) {
+            free(v.value);
+            return CACHE_MISS;
+        }
+    } else if(v.size == -1) {
+        if(errno != ENODATA && errno != ENOTSUP)
+            return CACHE_MISS;
+        v.size = -errno;
+    } else {
+        v.value = small;
+    }
+
+    cache_put(&xattr_cache, st, xattr_put, &v);
+    res = xattr_answer(&v, q);
+    if(v.value != small)
+        free(v.value);
+    return res;
+}
+
 static int rewrite_setxattr(const char *path, const char *name, const char *value,
         size_t size, int flags) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("setxattr", path);
     RLOCK(res = lsetxattr(new_path, name, value, size, flags));
-    free(new_path);
+    attr_changed(new_path, 0);
     if (res == -1)
         return -errno;
     return 0;
@@ -493,39 +1830,57 @@ static int rewrite_setxattr(const char *path, const char *name, const char *valu
 
 static int rewrite_getxattr(const char *path, const char *name, char *value,
         size_t size) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
+    struct stat st;
+    struct xattr_query q = { name, value, size };
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    if (xattr_cache.max > 0) {
+        RLOCK(res = lstat(new_path, &st));
+        if (res == 0) {
+            res = cache_get(&xattr_cache, &st, xattr_get, &q);
+            if (res == CACHE_MISS)
+                res = xattr_fetch(new_path, &st, &q);
+            if (res != CACHE_MISS)
+                return res;
+        }
+    }
+
     RLOCK(res = lgetxattr(new_path, name, value, size));
-    free(new_path);
     if (res == -1)
         return -errno;
     return res;
 }
 
 static int rewrite_listxattr(const char *path, char *list, size_t size) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
     RLOCK(res = llistxattr(new_path, list, size));
-    free(new_path);
     if (res == -1)
         return -errno;
     return res;
 }
 
 static int rewrite_removexattr(const char *path, const char *name) {
+    OP_PROBE;
+    REQUEST_ARENA;
     int res;
     char *new_path = rewrite(path);
     if (new_path == NULL)
         return -ENOMEM;
 
+    TRACE_MUTATION("removexattr", path);
     RLOCK(res = lremovexattr(new_path, name));
-    free(new_path);
+    attr_changed(new_path, 0);
     if (res == -1)
         return -errno;
     return 0;
@@ -534,17 +1889,44 @@ static int rewrite_removexattr(const char *path, const char *name) {
 
 static int rewrite_lock(const char *path, struct fuse_file_info *fi, int cmd,
         struct flock *lock) {
+    OP_PROBE;
     int res;
+    struct rewrite_file *f = get_file(fi);
 
     (void) path;
-    RLOCK(res = fcntl(fi->fh, cmd, lock));
+    if (cmd != F_GETLK && lock->l_type != F_UNLCK)
+        f->locked = 1;
+    RLOCK(res = fcntl(f->fd, cmd, lock));
     if (res == -1)
         return -errno;
 
     return res;
 }
 
+static void *rewrite_init(struct fuse_conn_info *conn) {
+    OP_PROBE;
+    struct timespec now;
+
+    (void) conn;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    stats.ready_usec = (now.tv_sec - start_time.tv_sec) * 1000000 + (now.tv_nsec - start_time.tv_nsec) / 1000;
+    DEBUG(1, "Ready in %lu us\n", stats.ready_usec);
+    stats_start();
+    if (config.warm > 0)
+        warm_threads_start();
+    return NULL;
+}
+
+static void rewrite_destroy(void *private_data) {
+    OP_PROBE;
+    (void) private_data;
+    stats_dump();
+    rewrite_save_profile();
+}
+
 static struct fuse_operations rewrite_oper = {
+    .init        = rewrite_init,
+    .destroy     = rewrite_destroy,
     .getattr     = rewrite_getattr,
     .fgetattr    = rewrite_fgetattr,
     .access      = rewrite_access,
@@ -586,7 +1968,23 @@ static struct fuse_operations rewrite_oper = {
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
     umask(0);
     parse_args(argc, argv, &args);
+    slab_init(&dirp_slab, "dirp", sizeof(struct rewrite_dirp));
+    slab_init(&file_slab, "file", sizeof(struct rewrite_file));
+    cache_init(&readlink_cache, "readlink", config.readlink_cache, free);
+    cache_init(&dir_cache, "dir", config.dir_cache, snapshot_release);
+    cache_set_max_bytes(&dir_cache, config.dir_cache_mb << 20, snapshot_weigh);
+    if (config.dir_cache)
+        flight_init(&dir_flights, "dir");
+#ifdef HAVE_SETXATTR
+    cache_init(&xattr_cache, "xattr", config.xattr_cache, xattr_destroy);
+#endif
+    attr_cache_init(config.attr_cache, config.attr_timeout);
+    if (config.coalesce)
+        flight_init(&lstat_flights, "lstat");
+    trace_open();
+    stats_init();
     return fuse_main(args.argc, args.argv, &rewrite_oper, NULL);
 }
@@ -0,0 +1,101 @@
+/* staticmap.c - memory-mapped exact path tables
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "staticmap.h"
+
+/* Map file, or exit if it isn't a valid index */
+struct staticmap *staticmap_open(const char *file) {
+    struct staticmap *map;
+    struct stat st;
+    void *data;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if(fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Cannot open map %s: %m\n", file);
+        exit(1);
+    }
+    if((size_t) st.st_size < sizeof(struct staticmap_header)) {
+        fprintf(stderr, "Invalid map %s: truncated\n", file);
+        exit(1);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %m\n", file);
+        exit(1);
+    }
+
+    map = malloc(sizeof(struct staticmap));
+    if(map == NULL || asprintf(&map->raw, "= %s", file) == -1) {
+        perror("malloc");
+        abort();
+    }
+    map->data = data;
+    map->size = st.st_size;
+    map->header = data;
+    map->buckets = (const struct staticmap_bucket *) (map->header + 1);
+    if(memcmp(map->header->magic, STATICMAP_MAGIC, 8) != 0) {
+        fprintf(stderr, "Invalid map %s: not a map\n", file);
+        exit(1);
+    }
+    if(map->header->byte_order == __builtin_bswap32(STATICMAP_BYTE_ORDER)) {
+        fprintf(stderr, "Invalid map %s: built with another byte order, rebuild it with mkmap\n", file);
+        exit(1);
+    }
+    if(map->header->byte_order != STATICMAP_BYTE_ORDER || map->header->version != STATICMAP_VERSION) {
+        fprintf(stderr, "Invalid map %s: built by another version, rebuild it with mkmap\n", file);
+        exit(1);
+    }
+    if(map->header->nbuckets == 0 ||
+            (map->header->nbuckets & (map->header->nbuckets - 1)) != 0 ||
+            map->header->nbuckets > (map->size - sizeof(struct staticmap_header)) / sizeof(struct staticmap_bucket)) {
+        fprintf(stderr, "Invalid map %s: bad header, rebuild it with mkmap\n", file);
+        exit(1);
+    }
+    map->records = sizeof(struct staticmap_header) + map->header->nbuckets * sizeof(struct staticmap_bucket);
+    /* lookups are random: don't read ahead */
+    madvise(data, st.st_size, MADV_RANDOM);
+    return map;
+}
+
+/* The value of key, or NULL */
+const char *staticmap_lookup(const struct staticmap *map, const char *key, size_t len) {
+    uint64_t hash = staticmap_hash(key, len), mask = map->header->nbuckets - 1, i, n;
+    const struct staticmap_bucket *bucket;
+    const struct staticmap_record *record;
+
+    for(i = hash & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        bucket = &map->buckets[i];
+        if(bucket->offset == 0)
+            return NULL;
+        if(bucket->hash != hash)
+            continue;
+        /* a corrupted file must not make us read outside of it, nor
+         * unaligned records */
+        if(bucket->offset < map->records || bucket->offset % STATICMAP_ALIGN != 0 ||
+                bucket->offset > map->size - sizeof(struct staticmap_record))
+            return NULL;
+        record = (const struct staticmap_record *) (map->data + bucket->offset);
+        if((uint64_t) record->key_len + record->value_len + 2 > map->size - bucket->offset - sizeof(struct staticmap_record))
+            return NULL;
+        if(record->key_len == len && memcmp(record->data, key, len) == 0 &&
+                record->data[record->key_len + 1 + record->value_len] == 0)
+            return record->data + record->key_len + 1;
+    }
+    return NULL;
+}
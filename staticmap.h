@@ -0,0 +1,57 @@
+/* Static maps: exact path -> path tables built offline by mkmap and
+ * mmap'd by "= FILE" rules, so that millions of entries cost no parsing and
+ * are shared between processes through the page cache.
+ *
+ * File layout, in the byte order of the machine which built it, so maps
+ * are rejected elsewhere:
+ *   struct staticmap_header
+ *   struct staticmap_bucket[nbuckets], an open addressing table probed
+ *       linearly from hash & (nbuckets - 1)
+ *   records, aligned on STATICMAP_ALIGN bytes: uint32_t key_len,
+ *       value_len, then the key and the value, both NUL-terminated,
+ *       without their leading /
+ */
+#define STATICMAP_MAGIC "RWFSMAP1"
+#define STATICMAP_BYTE_ORDER 0x01020304
+#define STATICMAP_VERSION 2
+#define STATICMAP_ALIGN 8
+
+struct staticmap_header {
+    char magic[8];
+    uint32_t byte_order; /* STATICMAP_BYTE_ORDER */
+    uint32_t version; /* STATICMAP_VERSION, bumped by layout changes */
+    uint64_t nbuckets; /* power of two */
+    uint64_t count;
+};
+
+struct staticmap_bucket {
+    uint64_t hash;
+    uint64_t offset; /* of the record in the file, 0 for an empty bucket */
+};
+
+struct staticmap_record {
+    uint32_t key_len, value_len;
+    char data[];
+};
+
+/* FNV-1a */
+static inline uint64_t staticmap_hash(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return hash;
+}
+
+struct staticmap {
+    char *raw; /* "= FILE", for messages */
+    const char *data;
+    size_t size;
+    const struct staticmap_header *header;
+    const struct staticmap_bucket *buckets;
+    uint64_t records; /* offset of the first record */
+};
+
+struct staticmap *staticmap_open(const char *file);
+const char *staticmap_lookup(const struct staticmap *map, const char *key, size_t len);
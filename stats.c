@@ -0,0 +1,100 @@
+/* stats.c - counters reporting for rewritefs
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include "rewrite.h"
+#include "stats.h"
+#include "cache.h"
+#include "alloc.h"
+#include "attr.h"
+#include "flight.h"
+#include "account.h"
+
+struct stats stats;
+
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Block SIGUSR1 before FUSE threads are created, so that only the stats
+ * thread receives it */
+void stats_init(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void stats_dump(void) {
+    FILE *fd = stderr;
+
+    pthread_mutex_lock(&dump_lock);
+    if(config.stats_file) {
+        fd = fopen(config.stats_file, "w");
+        if(fd == NULL) {
+            perror("opening stats file");
+            pthread_mutex_unlock(&dump_lock);
+            return;
+        }
+    }
+
+    fprintf(fd, "load_usec: %lu\n", stats.load_usec);
+    fprintf(fd, "ready_usec: %lu\n", stats.ready_usec);
+    fprintf(fd, "regexp_limit_hits: %lu\n", stats.regexp_limit_hits);
+    fprintf(fd, "xdev_renames: %lu\n", stats.xdev_renames);
+    fprintf(fd, "direct_io_bounces: %lu\n", stats.direct_io_bounces);
+    fprintf(fd, "flushes_skipped: %lu\n", stats.flushes_skipped);
+    fprintf(fd, "warm: %lu entries, %lu cancelled, %lu dropped\n",
+        stats.warm_entries, stats.warm_cancelled, stats.warm_dropped);
+    fprintf(fd, "statfs_cache: %lu hits, %lu misses, %lu stats skipped\n",
+        stats.statfs_hits, stats.statfs_misses, stats.statfs_stats_skipped);
+    cache_stats(fd);
+    attr_cache_stats(fd);
+    flight_stats(fd);
+    account_stats(fd);
+    alloc_stats(fd);
+    rewrite_stats(fd);
+
+    if(fd != stderr)
+        fclose(fd);
+    else
+        fflush(fd);
+    pthread_mutex_unlock(&dump_lock);
+}
+
+static void *stats_thread(void *arg) {
+    sigset_t set;
+    int sig;
+
+    (void) arg;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while(sigwait(&set, &sig) == 0)
+        stats_dump();
+    return NULL;
+}
+
+/* Must be called after fuse daemonized, since fork() only keeps the calling
+ * thread */
+void stats_start(void) {
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, stats_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,20 @@
+/* Counters shared by all threads, dumped on SIGUSR1 and at unmount */
+struct stats {
+    unsigned long load_usec; /* parsing and compiling the configuration */
+    unsigned long ready_usec; /* from start to the filesystem being ready */
+    unsigned long regexp_limit_hits;
+    unsigned long xdev_renames;
+    unsigned long direct_io_bounces;
+    unsigned long flushes_skipped;
+    unsigned long warm_entries, warm_cancelled, warm_dropped;
+    unsigned long statfs_hits, statfs_misses, statfs_stats_skipped;
+};
+
+extern struct stats stats;
+
+#define STAT_INC(field) __sync_fetch_and_add(&stats.field, 1)
+#define STAT_ADD(field, n) __sync_fetch_and_add(&stats.field, (n))
+
+void stats_init(void);
+void stats_start(void);
+void stats_dump(void);
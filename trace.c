@@ -0,0 +1,90 @@
+/* trace.c - request trace for offline cache sizing
+ *
+ * This program can be distributed under the terms of the GNU GPL.
+ * See the file COPYING.
+ */
+
+#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <fuse.h>
+
+#include "rewrite.h"
+#include "trace.h"
+
+FILE *trace_fd;
+
+static struct timespec trace_start;
+
+void trace_open(void) {
+    if(config.trace_file == NULL)
+        return;
+    trace_fd = fopen(config.trace_file, "a");
+    if(trace_fd == NULL) {
+        perror("opening trace file");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+}
+
+unsigned long trace_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace_start.tv_sec) * 1000000 + (now.tv_nsec - trace_start.tv_nsec) / 1000;
+}
+
+/* Write path, escaped, and the end of the line. Must be called with
+ * trace_fd locked. */
+static void put_path(const char *path) {
+    for(; *path; path++) {
+        if(*path == '\\')
+            fputs_unlocked("\\\\", trace_fd);
+        else if(*path == '\n')
+            fputs_unlocked("\\n", trace_fd);
+        else
+            fputc_unlocked(*path, trace_fd);
+    }
+    fputc_unlocked('\n', trace_fd);
+}
+
+/* FNV-1a, so that command lines don't end up in the trace */
+static unsigned long caller_hash(const char *caller) {
+    unsigned long hash = 14695981039346656037UL;
+
+    if(caller == NULL)
+        return 0;
+    for(; *caller; caller++)
+        hash = (hash ^ (unsigned char)*caller) * 1099511628211UL;
+    return hash ? hash : 1;
+}
+
+void trace_rewrite(const char *path, pid_t pid, const char *caller, unsigned long caller_usec, unsigned long rewrite_usec) {
+    flockfile(trace_fd);
+    fprintf(trace_fd, "R %lu %d %lx %lu %lu ", trace_usec(), pid,
+        caller_hash(caller), caller_usec, rewrite_usec);
+    put_path(path);
+    funlockfile(trace_fd);
+}
+
+void trace_getattr(const char *path, int err, unsigned long rewrite_usec, unsigned long syscall_usec) {
+    flockfile(trace_fd);
+    fprintf(trace_fd, "A %lu %d %lu %lu ", trace_usec(), err, rewrite_usec, syscall_usec);
+    put_path(path);
+    funlockfile(trace_fd);
+}
+
+void trace_mutation(const char *op, const char *path) {
+    /* the file may be unlinked already, see flag_nullpath_ok */
+    if(path == NULL)
+        return;
+    flockfile(trace_fd);
+    fprintf(trace_fd, "M %lu %s ", trace_usec(), op);
+    put_path(path);
+    funlockfile(trace_fd);
+}
@@ -0,0 +1,23 @@
+/* Request trace, written with -o trace=FILE and replayed offline by
+ * cachesim to size caches. One event per line, times in microseconds:
+ *
+ *   R <time> <pid> <caller> <caller_usec> <rewrite_usec> <path>
+ *       a rewrite; caller is a hash of the command line, 0 when no context
+ *       needed it, and caller_usec the part spent matching contexts
+ *   A <time> <errno> <rewrite_usec> <syscall_usec> <path>
+ *       a getattr and its result
+ *   M <time> <op> <path>
+ *       an operation changing the attributes of path
+ *
+ * Paths are the ones seen on the mount point, with \ and newlines escaped.
+ */
+extern FILE *trace_fd;
+
+#define TRACING (trace_fd != NULL)
+#define TRACE_MUTATION(op, path) if(trace_fd) trace_mutation(op, path)
+
+void trace_open(void);
+unsigned long trace_usec(void);
+void trace_rewrite(const char *path, pid_t pid, const char *caller, unsigned long caller_usec, unsigned long rewrite_usec);
+void trace_getattr(const char *path, int err, unsigned long rewrite_usec, unsigned long syscall_usec);
+void trace_mutation(const char *op, const char *path);